@@ -10,23 +10,27 @@ CONFIG += c++17
 
 VERSION = 1.0.0.1
 
+include(core.pri)
+
 SOURCES += \
     aboutdialog.cpp \
     exportdialog.cpp \
-    imageprocessing.cpp \
+    imageexporter.cpp \
     main.cpp \
     mainwindow.cpp \
     oddslider.cpp \
     oddspinbox.cpp \
+    project.cpp \
     settings.cpp
 
 HEADERS += \
     aboutdialog.h \
     exportdialog.h \
-    imageprocessing.h \
+    imageexporter.h \
     mainwindow.h \
     oddslider.h \
     oddspinbox.h \
+    project.h \
     settings.h
 
 FORMS += \
@@ -39,13 +43,8 @@ qnx: target.path = /tmp/$${TARGET}/bin
 else: unix:!android: target.path = /opt/$${TARGET}/bin
 !isEmpty(target.path): INSTALLS += target
 
-INCLUDEPATH += D:/OpenCV/opencv/build/include
-DEPENDPATH += D:/OpenCV/opencv/build/include
-
 # if OS is windows
 win32 {
-    win32:CONFIG(release, debug|release): LIBS += -LD:/OpenCV/opencv/build/x64/vc16/lib/ -lopencv_world4100
-    else:win32:CONFIG(debug, debug|release): LIBS += -LD:/OpenCV/opencv/build/x64/vc16/lib/ -lopencv_world4100d
     RC_ICONS = focuspocus.ico
 }
 
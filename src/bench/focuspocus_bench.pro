@@ -0,0 +1,20 @@
+# Microbenchmarks and reference checks of the processing kernels, see kernelbenchmark.h
+
+TEMPLATE = app
+TARGET = focuspocus_bench
+
+QT = core
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+VERSION = 1.0.0.1
+
+include(../core.pri)
+
+SOURCES += \
+    kernelbenchmark.cpp \
+    main.cpp
+
+HEADERS += \
+    kernelbenchmark.h
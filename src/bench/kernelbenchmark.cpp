@@ -0,0 +1,468 @@
+/****************************************************************************
+** File Name:   kernelbenchmark.cpp
+**
+** Description:
+**     This file contains the implementation of the KernelBenchmark class,
+**     which times the local variance, depth map update, depth map smoothing
+**     and compositing steps on synthetic images, checks the kernels for
+**     each instruction set against their references, measures how far
+**     reduced resolution depth maps are from the full resolution one and
+**     measures the throughput of time-lapse series.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "kernelbenchmark.h"
+#include <kernels.h>
+#include <QDir>
+#include <QTemporaryDir>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+
+KernelBenchmark::KernelBenchmark()
+    : rng(0x466f6375)
+{}
+
+/// Runs a step several times
+/// \param step The step to time
+/// \param repeats The number of runs
+/// \return The median run time in milliseconds
+double KernelBenchmark::medianMilliseconds(const std::function<void()> &step, int repeats) {
+    std::vector<double> times;
+    for (int i = 0; i < std::max(1, repeats); i++) {
+        auto start = std::chrono::steady_clock::now();
+        step();
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+    return times[times.size() / 2];
+}
+
+/// Computes the local variance one window at a time, the reference for compute_local_variance.
+/// The border is mirrored the way cv::boxFilter mirrors it.
+/// \param input The input image (CV_64F)
+/// \param output The variance of every window (CV_64F)
+/// \param windowSize The window size
+void KernelBenchmark::referenceLocalVariance(const cv::Mat &input, cv::Mat &output, int windowSize) {
+    output.create(input.size(), CV_64F);
+    int radius = windowSize / 2;
+    double count = static_cast<double>(windowSize) * windowSize;
+    for (int r = 0; r < input.rows; r++) {
+        for (int c = 0; c < input.cols; c++) {
+            double sum = 0.0, sumSquares = 0.0;
+            for (int dy = -radius; dy <= radius; dy++) {
+                int y = cv::borderInterpolate(r + dy, input.rows, cv::BORDER_REFLECT_101);
+                for (int dx = -radius; dx <= radius; dx++) {
+                    double value = input.at<double>(y, cv::borderInterpolate(c + dx, input.cols, cv::BORDER_REFLECT_101));
+                    sum += value;
+                    sumSquares += value * value;
+                }
+            }
+            double mean = sum / count;
+            output.at<double>(r, c) = sumSquares / count - mean * mean;
+        }
+    }
+}
+
+/// Finds the sharpest layer of every pixel the way the original depth estimation did, taking the
+/// layers in order and letting a later layer win a tie
+/// \param sharpness The sharpness of each layer (CV_64F rows)
+/// \param sharpnessMax Receives the highest sharpness (CV_64F)
+/// \param depth Receives the index of the sharpest layer (CV_16U)
+void KernelBenchmark::referenceDepthUpdate(const std::vector<cv::Mat> &sharpness, cv::Mat &sharpnessMax, cv::Mat &depth) {
+    sharpnessMax = cv::Mat::zeros(sharpness[0].size(), CV_64F);
+    depth = cv::Mat::zeros(sharpness[0].size(), CV_16U);
+    for (size_t layer = 0; layer < sharpness.size(); layer++) {
+        for (int r = 0; r < depth.rows; r++) {
+            for (int c = 0; c < depth.cols; c++) {
+                double value = sharpness[layer].at<double>(r, c);
+                if (value >= sharpnessMax.at<double>(r, c)) {
+                    sharpnessMax.at<double>(r, c) = value;
+                    depth.at<ushort>(r, c) = static_cast<ushort>(layer);
+                }
+            }
+        }
+    }
+}
+
+/// Composites one row the way the original floating point composite did
+/// \param pixels One row per layer (CV_8UC3)
+/// \param depth The depth row (CV_16U fixed point)
+/// \param fractionBits The fraction bits of the depth row
+/// \param blendLayers Whether to blend neighbouring layers
+/// \param composite Receives the composite row (CV_8UC3)
+void KernelBenchmark::referenceComposite(const cv::Mat &pixels, const cv::Mat &depth, int fractionBits, bool blendLayers, cv::Mat &composite) {
+    int numImages = pixels.rows;
+    composite.create(depth.size(), CV_8UC3);
+    for (int c = 0; c < depth.cols; c++) {
+        float depthValue = depth.at<ushort>(0, c) / static_cast<float>(1 << fractionBits);
+        if (blendLayers) {
+            int lowerLayer = std::clamp(static_cast<int>(std::floor(depthValue)), 0, numImages - 1);
+            int upperLayer = std::clamp(static_cast<int>(std::ceil(depthValue)), 0, numImages - 1);
+            float weight = depthValue - lowerLayer;
+            cv::Vec3b lowerPixel = pixels.at<cv::Vec3b>(lowerLayer, c);
+            cv::Vec3b upperPixel = pixels.at<cv::Vec3b>(upperLayer, c);
+            for (int i = 0; i < 3; i++) {
+                composite.at<cv::Vec3b>(0, c)[i] = static_cast<uchar>((1.0f - weight) * lowerPixel[i] + weight * upperPixel[i]);
+            }
+        }
+        else {
+            composite.at<cv::Vec3b>(0, c) = pixels.at<cv::Vec3b>(static_cast<int>(std::round(depthValue)), c);
+        }
+    }
+}
+
+/// Filters the whole depth map in one bilateral filter call, the reference for smoothing_pass
+/// \param depthMap The depth map (CV_16U fixed point)
+/// \param smoothed Receives the filtered depth map (CV_16U fixed point)
+/// \param smoothKernelSize The kernel size for the smoothing at full resolution
+/// \param smoothStrength The strength of the smoothing
+/// \param depthScale The depth map resolution divisor
+/// \param fractionBits The number of fractional bits of the depth map
+void KernelBenchmark::referenceSmoothing(const cv::Mat &depthMap, cv::Mat &smoothed, int smoothKernelSize, int smoothStrength, int depthScale, int fractionBits) {
+    const double fixedScale = 1 << fractionBits;
+    int kernelSize = depthScale > 1 ? std::max(1, (smoothKernelSize / depthScale) | 1) : smoothKernelSize;
+    cv::Mat values, filtered;
+    depthMap.convertTo(values, CV_32F, 1.0 / fixedScale);
+    cv::bilateralFilter(values, filtered, kernelSize, smoothStrength, static_cast<double>(smoothStrength) / depthScale);
+    filtered.convertTo(smoothed, CV_16U, fixedScale);
+}
+
+/// Creates layers of noise that are blurred by different amounts, so that each layer is the
+/// sharpest somewhere once the blur of the layers is shifted across the image
+/// \param size The layer size
+/// \param layers The number of layers
+/// \return The layers (CV_8UC3)
+std::vector<cv::Mat> KernelBenchmark::makeLayers(const cv::Size &size, int layers) {
+    cv::Mat noise(size, CV_8UC3);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+
+    std::vector<cv::Mat> images;
+    for (int i = 0; i < layers; i++) {
+        cv::Mat layer;
+        cv::GaussianBlur(noise, layer, cv::Size(0, 0), 0.5 + (i % 4));
+        images.push_back(layer);
+    }
+    return images;
+}
+
+/// Creates a smooth depth map that runs through all layers
+/// \param size The depth map size
+/// \param layers The number of layers
+/// \param fractionBits The fraction bits of the depth map, 0 for a raw depth map
+/// \return The depth map (CV_16U fixed point)
+cv::Mat KernelBenchmark::makeDepthMap(const cv::Size &size, int layers, int fractionBits) {
+    cv::Mat coarse(8, 8, CV_32F);
+    rng.fill(coarse, cv::RNG::UNIFORM, 0.0, static_cast<double>(layers - 1));
+
+    cv::Mat smooth, depthMap;
+    cv::resize(coarse, smooth, size, 0, 0, cv::INTER_LINEAR);
+    smooth.convertTo(depthMap, CV_16U, 1 << fractionBits);
+    return depthMap;
+}
+
+/// Creates layers of a scene whose depth changes smoothly across the image. Each layer is sharp
+/// where the scene is at its focus distance and blurred elsewhere, so every layer wins somewhere.
+/// \param size The layer size
+/// \param layers The number of layers
+/// \return The layers (CV_8UC3)
+std::vector<cv::Mat> KernelBenchmark::makeFocusLayers(const cv::Size &size, int layers) {
+    cv::Mat noise(size, CV_8UC3);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+    cv::Mat sharp, blurred;
+    noise.convertTo(sharp, CV_32FC3);
+    cv::GaussianBlur(sharp, blurred, cv::Size(0, 0), 3.0);
+
+    cv::Mat scene;
+    makeDepthMap(size, layers, 8).convertTo(scene, CV_32F, 1.0 / 256);
+
+    std::vector<cv::Mat> images;
+    for (int i = 0; i < layers; i++) {
+        cv::Mat distance = scene - static_cast<float>(i);
+        cv::Mat weight;
+        cv::exp(distance.mul(distance) * -0.5f, weight);
+        cv::Mat weight3;
+        cv::merge(std::vector<cv::Mat>(3, weight), weight3);
+        cv::Mat layer;
+        cv::Mat(sharp.mul(weight3) + blurred.mul(cv::Scalar::all(1.0) - weight3)).convertTo(layer, CV_8UC3);
+        images.push_back(layer);
+    }
+    return images;
+}
+
+/// Scores the layers and smooths the depth map the way stack_region does
+/// \param images The layers
+/// \param params The stacking parameters, depthScale sets the scoring resolution
+/// \return The full resolution depth map (CV_16U fixed point)
+cv::Mat KernelBenchmark::estimateDepthMap(const std::vector<cv::Mat> &images, const StackParameters &params) {
+    int depthScale = std::max(1, params.depthScale);
+    cv::Size size = images[0].size();
+    cv::Size depthSize((size.width + depthScale - 1) / depthScale, (size.height + depthScale - 1) / depthScale);
+    int scoringKernelSize = depthScale > 1 ? std::max(3, (params.laplaceKernelSize / depthScale) | 1) : params.laplaceKernelSize;
+    cv::Mat sharpnessMax = cv::Mat::zeros(depthSize, CV_64F);
+    cv::Mat rawDepthMap = cv::Mat::zeros(depthSize, CV_16U);
+    ScoreWorkspace workspace;
+    for (size_t i = 0; i < images.size(); i++) {
+        cv::Mat scoringImage = images[i];
+        if (depthScale > 1) {
+            ImageProcessing::reduce_to_depth_grid(images[i], workspace.scoring, depthScale);
+            scoringImage = workspace.scoring;
+        }
+        processor.update_depth_map(processor.compute_sharpness(scoringImage, scoringKernelSize, workspace), static_cast<int>(i), sharpnessMax, rawDepthMap);
+    }
+    return processor.create_depth_map(rawDepthMap, images[0], static_cast<int>(images.size()), params);
+}
+
+/// Reports how far the depth maps estimated at reduced resolution are from the full resolution
+/// depth map: the mean and largest difference in layers, and the share of pixels that are more
+/// than half a layer off and so composite from another layer
+/// \param size The layer size
+/// \param layers The number of layers
+void KernelBenchmark::compareDepthScales(const cv::Size &size, int layers) {
+    std::vector<cv::Mat> images = makeFocusLayers(size, layers);
+    double fixedScale = static_cast<double>(1 << ImageProcessing::depth_fraction_bits(layers));
+
+    StackParameters params;
+    cv::Mat fullDepth;
+    estimateDepthMap(images, params).convertTo(fullDepth, CV_64F, 1.0 / fixedScale);
+    for (int depthScale : {2, 4, 8}) {
+        params.depthScale = depthScale;
+        cv::Mat depth, difference;
+        estimateDepthMap(images, params).convertTo(depth, CV_64F, 1.0 / fixedScale);
+        difference = cv::abs(depth - fullDepth);
+        double maxDifference = 0.0;
+        cv::minMaxLoc(difference, nullptr, &maxDifference);
+        double offShare = cv::countNonZero(difference > 0.5) * 100.0 / difference.total();
+        std::cout << std::setw(32) << std::left << "depth map 1/" + std::to_string(depthScale) + " vs full"
+                  << "mean " << cv::mean(difference)[0] << ", max " << maxDifference << " layers, "
+                  << offShare << "% of pixels off by more than half a layer" << std::endl;
+    }
+}
+
+/// Times stack_series on a time-lapse of synthetic stacks and reports the stacks and frames per
+/// second. The frames are written to a temporary folder first, the timed run decodes them like a
+/// real series. Each stack is shifted by a pixel against the previous one, so that the alignment
+/// of every stack refines the prior of the previous stack.
+/// \param size The frame size
+/// \param layers The number of frames per stack
+/// \param repeats The number of runs, the median is reported
+void KernelBenchmark::measureSeries(const cv::Size &size, int layers, int repeats) {
+    const int stackCount = 4;
+    QTemporaryDir folder;
+    if (!folder.isValid()) {
+        std::cerr << "Could not create a folder for the series frames" << std::endl;
+        return;
+    }
+
+    std::vector<cv::Mat> images = makeFocusLayers(size, layers);
+    std::vector<QStringList> stacks(stackCount);
+    for (int s = 0; s < stackCount; s++) {
+        cv::Mat shift = (cv::Mat_<double>(2, 3) << 1, 0, s, 0, 1, s);
+        for (int i = 0; i < layers; i++) {
+            cv::Mat frame;
+            cv::warpAffine(images[i], frame, shift, size, cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+            QString file = QDir(folder.path()).filePath(QString("stack%1_frame%2.bmp").arg(s).arg(i, 3, 10, QChar('0')));
+            cv::imwrite(file.toStdString(), frame);
+            stacks[s] << file;
+        }
+    }
+
+    StackParameters params;
+    int written = 0;
+    double ms = medianMilliseconds([&]() {
+        written = processor.stack_series(stacks, params, [](int, const cv::Mat &) { return true; });
+    }, std::min(repeats, 3));
+    if (written != stackCount) {
+        std::cerr << "Only " << written << " of " << stackCount << " series stacks were stacked" << std::endl;
+    }
+    double seconds = ms / 1000.0;
+    std::cout << std::setw(32) << std::left << "stack_series " + std::to_string(stackCount) + " stacks"
+              << std::setw(14) << std::right << ms << " ms " << stackCount / seconds << " stacks/s "
+              << stackCount * layers / seconds << " frames/s" << std::endl;
+}
+
+/// Times every step for each image size and OpenCV thread count. The kernel table steps are timed
+/// for every table the CPU supports.
+/// \param sizes The image sizes
+/// \param threadCounts The OpenCV thread counts
+/// \param layers The number of layers
+/// \param repeats The number of runs per step, the median is reported
+void KernelBenchmark::run(const std::vector<cv::Size> &sizes, const std::vector<int> &threadCounts, int layers, int repeats) {
+    int previousThreads = cv::getNumThreads();
+    std::cout << std::fixed << std::setprecision(2);
+
+    for (const cv::Size &size : sizes) {
+        std::cout << "== " << size.width << "x" << size.height << ", " << layers << " layers" << std::endl;
+        compareDepthScales(size, layers);
+        measureSeries(size, layers, repeats);
+        std::vector<cv::Mat> images = makeLayers(size, layers);
+        int fractionBits = ImageProcessing::depth_fraction_bits(layers);
+        cv::Mat rawDepthMap = makeDepthMap(size, layers, 0);
+        cv::Mat depthMap = makeDepthMap(size, layers, fractionBits);
+
+        ScoreWorkspace workspace;
+        std::vector<cv::Mat> sharpness;
+        for (const cv::Mat &image : images) {
+            sharpness.push_back(processor.compute_sharpness(image, 9, workspace).clone());
+        }
+
+        for (int threads : threadCounts) {
+            cv::setNumThreads(threads);
+            auto report = [&](const std::string &step, double ms) {
+                std::cout << std::setw(32) << std::left << step << std::setw(4) << std::right << threads << " threads " << std::setw(10) << ms << " ms" << std::endl;
+            };
+
+            //The kernel table steps run over bands of rows like the composite does
+            for (const Kernels *table : available_kernels()) {
+                cv::Mat sharpnessMax(size, CV_64F), depth(size, CV_16U);
+                report(std::string("update_depth_row ") + table->name, medianMilliseconds([&]() {
+                    sharpnessMax.setTo(0.0);
+                    depth.setTo(0);
+                    for (int layer = 0; layer < layers; layer++) {
+                        cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range &range) {
+                            for (int r = range.start; r < range.end; r++) {
+                                table->update_depth_row(sharpness[layer].ptr<double>(r), sharpnessMax.ptr<double>(r), depth.ptr<ushort>(r), size.width, static_cast<ushort>(layer));
+                            }
+                        });
+                    }
+                }, repeats));
+
+                cv::Mat accumulator(size, CV_16UC3);
+                report(std::string("accumulate_layer_row ") + table->name, medianMilliseconds([&]() {
+                    accumulator.setTo(0);
+                    for (int layer = 0; layer < layers; layer++) {
+                        cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range &range) {
+                            for (int r = range.start; r < range.end; r++) {
+                                table->accumulate_layer_row(depthMap.ptr<ushort>(r), images[layer].ptr<uchar>(r), accumulator.ptr<ushort>(r), size.width, layer, layers, fractionBits, true);
+                            }
+                        });
+                    }
+                }, repeats));
+            }
+
+            cv::Mat variance;
+            report("compute_local_variance", medianMilliseconds([&]() {
+                processor.compute_local_variance(workspace.laplacian, variance, 9, workspace);
+            }, repeats));
+            report("smooth_depth_map (1 pass)", medianMilliseconds([&]() {
+                processor.smooth_depth_map(rawDepthMap, 17, 100, 1, 1, fractionBits);
+            }, repeats));
+            report("composite, blended", medianMilliseconds([&]() {
+                processor.create_composite_image_from_depth_map(images, depthMap, true);
+            }, repeats));
+            report("composite, nearest layer", medianMilliseconds([&]() {
+                processor.create_composite_image_from_depth_map(images, depthMap, false);
+            }, repeats));
+        }
+    }
+    cv::setNumThreads(previousThreads);
+}
+
+/// Compares the kernels of every instruction set with scalar versions of the original loops, the
+/// strip wise smoothing pass with one bilateral filter over the whole map and compute_local_variance
+/// with a scalar window sum, which must match to within 1e-9 of the local mean square. Sizes are
+/// odd so that the vector loops have remainders.
+/// \return The number of failed checks
+int KernelBenchmark::verify() {
+    int failures = 0;
+    auto check = [&](const std::string &name, bool passed, double error) {
+        std::cout << (passed ? "PASS " : "FAIL ") << name << " (max error " << error << ")" << std::endl;
+        failures += passed ? 0 : 1;
+    };
+
+    const int cols = 1037;
+    const int layerCount = 7;
+
+    //Few sharpness levels give many ties, layers arrive out of order as they do from several threads
+    std::vector<cv::Mat> sharpness;
+    for (int layer = 0; layer < layerCount; layer++) {
+        cv::Mat levels(1, cols, CV_32S);
+        rng.fill(levels, cv::RNG::UNIFORM, 0, 8);
+        cv::Mat values;
+        levels.convertTo(values, CV_64F);
+        sharpness.push_back(values);
+    }
+    std::vector<int> order(layerCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::swap(order[1], order[5]);
+    std::swap(order[2], order[6]);
+
+    cv::Mat pixels(layerCount, cols, CV_8UC3);
+    rng.fill(pixels, cv::RNG::UNIFORM, 0, 256);
+
+    cv::Mat expectedMax, expectedDepth;
+    referenceDepthUpdate(sharpness, expectedMax, expectedDepth);
+
+    for (const Kernels *table : available_kernels()) {
+        cv::Mat tableMax = cv::Mat::zeros(1, cols, CV_64F), tableDepth = cv::Mat::zeros(1, cols, CV_16U);
+        for (int layer : order) {
+            table->update_depth_row(sharpness[layer].ptr<double>(), tableMax.ptr<double>(), tableDepth.ptr<ushort>(), cols, static_cast<ushort>(layer));
+        }
+        double error = cv::norm(expectedDepth, tableDepth, cv::NORM_INF) + cv::norm(expectedMax, tableMax, cv::NORM_INF);
+        check(std::string("update_depth_row ") + table->name, error == 0.0, error);
+
+        //The fixed point composite rounds where the float composite truncated, blending may be one level off
+        for (int fractionBits : {0, 4, 8}) {
+            for (bool blend : {true, false}) {
+                cv::Mat depth(1, cols, CV_16U);
+                rng.fill(depth, cv::RNG::UNIFORM, 0, ((layerCount - 1) << fractionBits) + 1);
+                cv::Mat tableSum = cv::Mat::zeros(1, cols, CV_16UC3);
+                for (int layer = 0; layer < layerCount; layer++) {
+                    table->accumulate_layer_row(depth.ptr<ushort>(), pixels.ptr<uchar>(layer), tableSum.ptr<ushort>(), cols, layer, layerCount, fractionBits, blend);
+                }
+                cv::Mat composite, expected;
+                tableSum.convertTo(composite, CV_8UC3, 1.0 / (1 << fractionBits));
+                referenceComposite(pixels, depth, fractionBits, blend, expected);
+                error = cv::norm(expected, composite, cv::NORM_INF);
+                check(std::string("accumulate_layer_row ") + table->name + (blend ? " blended" : " nearest") + " bits=" + std::to_string(fractionBits), error <= (blend ? 1.0 : 0.0), error);
+            }
+        }
+    }
+
+    //Strips only see their halo, the whole map filtered at once must agree to within 1/64 of a layer
+    const int fractionBits = 8;
+    cv::Mat rawDepth(301, 517, CV_16U);
+    rng.fill(rawDepth, cv::RNG::UNIFORM, 0, layerCount);
+    cv::Mat depthMap;
+    rawDepth.convertTo(depthMap, CV_16U, 1 << fractionBits);
+    for (int smoothStrength : {2, 100}) {
+        for (int depthScale : {1, 2}) {
+            cv::Mat smoothed(depthMap.size(), CV_16U), expected;
+            processor.smoothing_pass(depthMap, smoothed, 17, smoothStrength, depthScale, fractionBits);
+            referenceSmoothing(depthMap, expected, 17, smoothStrength, depthScale, fractionBits);
+            double error = cv::norm(expected, smoothed, cv::NORM_INF) / (1 << fractionBits);
+            check("smoothing_pass strength=" + std::to_string(smoothStrength) + " scale=" + std::to_string(depthScale), error <= 1.0 / 64, error);
+        }
+    }
+
+    //The Laplacian of an 8 bit image stays within +-8*255
+    cv::Mat laplacian(97, 131, CV_64F);
+    rng.fill(laplacian, cv::RNG::UNIFORM, -2040.0, 2040.0);
+    ScoreWorkspace workspace;
+    for (int windowSize : {3, 9, 17}) {
+        cv::Mat variance, expected;
+        processor.compute_local_variance(laplacian, variance, windowSize, workspace);
+        referenceLocalVariance(laplacian, expected, windowSize);
+
+        cv::Mat meanSquare;
+        cv::boxFilter(laplacian.mul(laplacian), meanSquare, CV_64F, cv::Size(windowSize, windowSize));
+        cv::Mat relative = cv::abs(variance - expected) / cv::max(meanSquare, 1.0);
+        double error = 0.0;
+        cv::minMaxLoc(relative, nullptr, &error);
+        check("compute_local_variance window=" + std::to_string(windowSize), error <= 1e-9, error);
+    }
+
+    std::cout << (failures == 0 ? "All checks passed" : std::to_string(failures) + " checks failed") << std::endl;
+    return failures;
+}
@@ -0,0 +1,38 @@
+#ifndef KERNELBENCHMARK_H
+#define KERNELBENCHMARK_H
+
+#include <imageprocessing.h>
+#include <functional>
+#include <vector>
+
+/// Times the hot processing steps on synthetic images and checks the optimized kernels against
+/// scalar versions of the original loops. Needs no input files.
+class KernelBenchmark
+{
+public:
+    KernelBenchmark();
+
+    // Times every step for each image size and OpenCV thread count
+    void run(const std::vector<cv::Size> &sizes, const std::vector<int> &threadCounts, int layers, int repeats);
+
+    // Compares the optimized kernels with their references, returns the number of failed checks
+    int verify();
+
+private:
+    ImageProcessing processor;
+    cv::RNG rng;
+
+    static double medianMilliseconds(const std::function<void()> &step, int repeats);
+    static void referenceLocalVariance(const cv::Mat &input, cv::Mat &output, int windowSize);
+    static void referenceDepthUpdate(const std::vector<cv::Mat> &sharpness, cv::Mat &sharpnessMax, cv::Mat &depth);
+    static void referenceComposite(const cv::Mat &pixels, const cv::Mat &depth, int fractionBits, bool blendLayers, cv::Mat &composite);
+    static void referenceSmoothing(const cv::Mat &depthMap, cv::Mat &smoothed, int smoothKernelSize, int smoothStrength, int depthScale, int fractionBits);
+    std::vector<cv::Mat> makeLayers(const cv::Size &size, int layers);
+    std::vector<cv::Mat> makeFocusLayers(const cv::Size &size, int layers);
+    cv::Mat makeDepthMap(const cv::Size &size, int layers, int fractionBits);
+    cv::Mat estimateDepthMap(const std::vector<cv::Mat> &images, const StackParameters &params);
+    void compareDepthScales(const cv::Size &size, int layers);
+    void measureSeries(const cv::Size &size, int layers, int repeats);
+};
+
+#endif // KERNELBENCHMARK_H
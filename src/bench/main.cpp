@@ -0,0 +1,82 @@
+/****************************************************************************
+** File Name:   main.cpp
+**
+** Description:
+**      This file contains the main function for the FocusPocus kernel
+**      benchmark. It checks the kernels against their references and then
+**      times them on synthetic images, no input files are needed.
+**
+**      focuspocus_bench [--verify] [--sizes <w>x<h>,...] [--threads <n>,...]
+**                       [--layers <n>] [--repeats <n>]
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "kernelbenchmark.h"
+#include <kernels.h>
+#include <QCoreApplication>
+#include <QStringList>
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    std::vector<cv::Size> sizes = {cv::Size(1024, 768), cv::Size(2048, 1536), cv::Size(4096, 3072)};
+    std::vector<int> threadCounts = {1, std::max(1, cores / 2), cores};
+    threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+    int layers = 8;
+    int repeats = 5;
+    bool verifyOnly = false;
+
+    QStringList args = a.arguments().mid(1);
+    while (!args.isEmpty()) {
+        QString option = args.takeFirst();
+        if (option == "--verify") {
+            verifyOnly = true;
+        }
+        else if (option == "--sizes" && !args.isEmpty()) {
+            sizes.clear();
+            for (const QString &size : args.takeFirst().split(',')) {
+                QStringList dimensions = size.split('x');
+                if (dimensions.size() == 2 && dimensions[0].toInt() > 0 && dimensions[1].toInt() > 0) {
+                    sizes.emplace_back(dimensions[0].toInt(), dimensions[1].toInt());
+                }
+            }
+        }
+        else if (option == "--threads" && !args.isEmpty()) {
+            threadCounts.clear();
+            for (const QString &threads : args.takeFirst().split(',')) {
+                threadCounts.push_back(std::max(1, threads.toInt()));
+            }
+        }
+        else if (option == "--layers" && !args.isEmpty()) {
+            layers = std::max(2, args.takeFirst().toInt());
+        }
+        else if (option == "--repeats" && !args.isEmpty()) {
+            repeats = std::max(1, args.takeFirst().toInt());
+        }
+        else {
+            std::cerr << "Usage: focuspocus_bench [--verify] [--sizes <w>x<h>,...] [--threads <n>,...] [--layers <n>] [--repeats <n>]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "Selected kernels: " << kernels().name << std::endl;
+    KernelBenchmark benchmark;
+    int failures = benchmark.verify();
+    if (!verifyOnly) {
+        benchmark.run(sizes, threadCounts, layers, repeats);
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+# Processing core shared by the application and the focuspocus_core library.
+# It only depends on Qt Core and OpenCV.
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += \
+    $$PWD/executionplanner.cpp \
+    $$PWD/focuspocus_core.cpp \
+    $$PWD/framesource.cpp \
+    $$PWD/imageprocessing.cpp \
+    $$PWD/kernels.cpp \
+    $$PWD/kernels_baseline.cpp
+
+HEADERS += \
+    $$PWD/executionplanner.h \
+    $$PWD/focuspocus_core.h \
+    $$PWD/framesource.h \
+    $$PWD/imageprocessing.h \
+    $$PWD/kernels.h \
+    $$PWD/kernels_impl.h \
+    $$PWD/pipeline.h
+
+# The kernels are compiled once per instruction set and picked at runtime
+contains(QT_ARCH, x86_64)|contains(QT_ARCH, i386) {
+    CONFIG += simd
+    DEFINES += FOCUSPOCUS_X86_KERNELS
+    SSE4_1_SOURCES += $$PWD/kernels_sse4.cpp
+    AVX2_SOURCES += $$PWD/kernels_avx2.cpp
+    AVX512F_SOURCES += $$PWD/kernels_avx512.cpp
+    !win32-msvc*: QMAKE_CFLAGS_AVX512F += -mavx512bw
+    win32-msvc*: QMAKE_CFLAGS_AVX512F = -arch:AVX512
+}
+
+win32 {
+    INCLUDEPATH += D:/OpenCV/opencv/build/include
+    DEPENDPATH += D:/OpenCV/opencv/build/include
+
+    win32:CONFIG(release, debug|release): LIBS += -LD:/OpenCV/opencv/build/x64/vc16/lib/ -lopencv_world4100
+    else:win32:CONFIG(debug, debug|release): LIBS += -LD:/OpenCV/opencv/build/x64/vc16/lib/ -lopencv_world4100d
+}
+
+# Other platforms use the system OpenCV
+unix {
+    CONFIG += link_pkgconfig
+    PKGCONFIG += opencv4
+}
@@ -0,0 +1,19 @@
+# Headless stacking library for embedding in other programs, see focuspocus_core.h
+
+TEMPLATE = lib
+TARGET = focuspocus_core
+
+QT = core
+
+CONFIG += c++17
+
+VERSION = 1.0.0.1
+
+include(../core.pri)
+
+unix:!android {
+    target.path = /usr/local/lib
+    headers.path = /usr/local/include/focuspocus
+    headers.files = ../focuspocus_core.h
+    INSTALLS += target headers
+}
@@ -0,0 +1,107 @@
+/****************************************************************************
+** File Name:   decodecache.cpp
+**
+** Description:
+**     This file contains the decode cache of the stacking daemon, which
+**     keeps decoded images in memory between jobs.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "decodecache.h"
+#include <opencv2/imgcodecs.hpp>
+#include <QFileInfo>
+#include <QDateTime>
+#include <iostream>
+
+DecodeCache::DecodeCache(size_t budgetBytes)
+    : budgetBytes(budgetBytes)
+{}
+
+/// Builds the cache key of a file
+/// \param file The file path
+/// \return The key, it changes when the file is modified
+QString DecodeCache::key(const QString &file) {
+    QFileInfo info(file);
+    return info.absoluteFilePath() + "|" + QString::number(info.size()) + "|" + QString::number(info.lastModified().toMSecsSinceEpoch());
+}
+
+/// Returns the decoded image of a file, decoding it on a miss. Images are shared with the cache,
+/// callers must not modify them.
+/// \param file The file path
+/// \return The decoded image, empty if the file could not be decoded
+cv::Mat DecodeCache::get(const QString &file) {
+    QString fileKey = key(file);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto entry = entries.find(fileKey);
+        if (entry != entries.end()) {
+            useOrder.splice(useOrder.begin(), useOrder, entry->second.use);
+            hitCount++;
+            return entry->second.image;
+        }
+    }
+
+    //Decode outside the lock so that several files are decoded in parallel
+    cv::Mat image = cv::imread(file.toStdString());
+    missCount++;
+    if (image.empty()) {
+        return image;
+    }
+
+    size_t bytes = image.total() * image.elemSize();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (bytes <= budgetBytes && entries.find(fileKey) == entries.end()) {
+        useOrder.push_front(fileKey);
+        entries[fileKey] = Entry{image, useOrder.begin()};
+        usedBytes += bytes;
+        evict();
+    }
+    return image;
+}
+
+/// Drops the least recently used images until the cache is within its budget
+void DecodeCache::evict() {
+    while (usedBytes > budgetBytes && !useOrder.empty()) {
+        auto entry = entries.find(useOrder.back());
+        usedBytes -= entry->second.image.total() * entry->second.image.elemSize();
+        entries.erase(entry);
+        useOrder.pop_back();
+    }
+}
+
+CachedImageSource::CachedImageSource(const QStringList &files, DecodeCache &cache)
+    : files(files), cache(cache)
+{}
+
+/// Returns the number of files
+/// \return The number of files
+int CachedImageSource::count() const {
+    return files.size();
+}
+
+/// Hands out the next file, from the cache if it has been decoded before
+/// \param index Receives the index of the frame
+/// \param frame Receives the decoded frame
+/// \return False when all files have been handed out
+bool CachedImageSource::next(int &index, cv::Mat &frame) {
+    do {
+        index = nextIndex.fetch_add(1);
+        if (index >= files.size()) {
+            return false;
+        }
+    } while (isSkipped(index));
+
+    frame = cache.get(files[index]);
+    if (frame.empty()) {
+        std::cerr << "Could not decode " << files[index].toStdString() << std::endl;
+    }
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef DECODECACHE_H
+#define DECODECACHE_H
+
+#include <QString>
+#include <QStringList>
+#include <opencv2/core/core.hpp>
+#include <framesource.h>
+#include <atomic>
+#include <list>
+#include <map>
+#include <mutex>
+
+/// Keeps recently decoded images in memory up to a byte budget. Entries are keyed by path,
+/// size and modification time, so a file that is overwritten is decoded again.
+class DecodeCache {
+public:
+    explicit DecodeCache(size_t budgetBytes);
+
+    // Returns the decoded image of a file, decoding it on a miss
+    cv::Mat get(const QString &file);
+
+    size_t hits() const { return hitCount; }
+    size_t misses() const { return missCount; }
+
+    // Builds the key of a file from its path, size and modification time
+    static QString key(const QString &file);
+
+private:
+    void evict();
+
+    struct Entry {
+        cv::Mat image;
+        std::list<QString>::iterator use;
+    };
+
+    size_t budgetBytes;
+    size_t usedBytes = 0;
+    std::map<QString, Entry> entries;
+    std::list<QString> useOrder; // Most recently used first
+    std::mutex mutex;
+    std::atomic<size_t> hitCount{0};
+    std::atomic<size_t> missCount{0};
+};
+
+/// Hands out image files through a decode cache
+class CachedImageSource : public FrameSource {
+public:
+    CachedImageSource(const QStringList &files, DecodeCache &cache);
+
+    int count() const override;
+    bool next(int &index, cv::Mat &frame) override;
+
+private:
+    QStringList files;
+    DecodeCache &cache;
+    std::atomic<int> nextIndex{0};
+};
+
+#endif // DECODECACHE_H
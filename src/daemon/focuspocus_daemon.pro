@@ -0,0 +1,31 @@
+# Long lived stacking daemon that serves stack jobs over a local socket, see stackdaemon.h
+
+TEMPLATE = app
+TARGET = focuspocus_daemon
+
+QT = core network
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+VERSION = 1.0.0.1
+
+include(../core.pri)
+
+SOURCES += \
+    ../settings.cpp \
+    decodecache.cpp \
+    main.cpp \
+    shardcoordinator.cpp \
+    stackdaemon.cpp
+
+HEADERS += \
+    ../settings.h \
+    decodecache.h \
+    shardcoordinator.h \
+    stackdaemon.h
+
+unix:!android {
+    target.path = /usr/local/bin
+    INSTALLS += target
+}
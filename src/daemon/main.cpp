@@ -0,0 +1,260 @@
+/****************************************************************************
+** File Name:   main.cpp
+**
+** Description:
+**      This file contains the main function for the FocusPocus stacking
+**      daemon. Started without arguments it serves stack jobs on a local
+**      socket, with --submit it sends a job to a running daemon. With --shard
+**      it stacks one large stack with several worker daemons, with --series
+**      it stacks a time-lapse series of stacks, one folder per stack.
+**
+**      focuspocus_daemon [--name <socket>] [--cache-mb <size>] [--output-dir <folder>...]
+**                        [--pipeline <decode>,<align>,<score>,<queue>]
+**      focuspocus_daemon [--name <socket>] --submit <output> <settings file> <images...>
+**      focuspocus_daemon --shard <workers> <output> <settings file> <images...>
+**      focuspocus_daemon [--pipeline ...] --series <output folder> <settings file> <stack folders...>
+**
+**      --pipeline sets the threads of the decode, align and score stages and
+**      the frames buffered between them, by default they follow the cores.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "stackdaemon.h"
+#include "shardcoordinator.h"
+#include <settings.h>
+#include <imageprocessing.h>
+#include <opencv2/imgcodecs.hpp>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDir>
+#include <QFileInfo>
+#include <iostream>
+
+/// Loads the parameters of a job
+/// \param settingsFile A parameter file saved by the application, or - for the defaults
+/// \param ok Set to false if the file could not be loaded
+/// \return The parameters with the settings keys
+static QMap<QString, QVariant> loadParameters(const QString &settingsFile, bool &ok)
+{
+    ok = true;
+    if (settingsFile == "-") {
+        return QMap<QString, QVariant>();
+    }
+    QMap<QString, QVariant> params = Settings::load(settingsFile, ok);
+    if (!ok) {
+        std::cerr << "Could not load " << settingsFile.toStdString() << std::endl;
+    }
+    return params;
+}
+
+/// Parses the thread counts of the pipeline stages and the queue capacity
+/// \param text The counts as <decode>,<align>,<score>,<queue>
+/// \param config Receives the configuration
+/// \return False if the text is not four positive numbers
+static bool parsePipelineConfig(const QString &text, PipelineConfig &config)
+{
+    QStringList parts = text.split(',');
+    if (parts.size() != 4) {
+        return false;
+    }
+    int values[4];
+    for (int i = 0; i < 4; i++) {
+        bool ok = false;
+        values[i] = parts[i].trimmed().toInt(&ok);
+        if (!ok || values[i] < 1) {
+            return false;
+        }
+    }
+    int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    config.decodeThreads = values[0];
+    config.alignThreads = values[1];
+    config.scoreThreads = values[2];
+    config.queueCapacity = values[3];
+    config.opencvThreads = std::max(1, cores / (config.alignThreads + config.scoreThreads));
+    return true;
+}
+
+/// Sends a stack job to a running daemon and prints its progress until it has finished
+/// \param name The socket name of the daemon
+/// \param output The file the result is written to
+/// \param settingsFile A parameter file saved by the application, or - for the defaults
+/// \param files The image files
+/// \return The exit code
+static int submit(const QString &name, const QString &output, const QString &settingsFile, const QStringList &files)
+{
+    bool ok = false;
+    QMap<QString, QVariant> params = loadParameters(settingsFile, ok);
+    if (!ok) {
+        return 1;
+    }
+
+    QLocalSocket socket;
+    socket.connectToServer(name);
+    if (!socket.waitForConnected(1000)) {
+        std::cerr << "No daemon is listening on " << name.toStdString() << std::endl;
+        return 1;
+    }
+
+    QStringList absoluteFiles;
+    for (const QString &file : files) {
+        absoluteFiles << QFileInfo(file).absoluteFilePath();
+    }
+
+    QDataStream out(&socket);
+    out << QString("stack") << absoluteFiles;
+    Settings::writeParameters(out, params);
+    out << QFileInfo(output).absoluteFilePath();
+    socket.flush();
+
+    //Read replies until the job has finished
+    QDataStream in(&socket);
+    while (socket.state() == QLocalSocket::ConnectedState) {
+        if (!socket.waitForReadyRead(-1)) {
+            break;
+        }
+        while (socket.bytesAvailable() > 0) {
+            in.startTransaction();
+            QString reply;
+            quint32 jobId = 0;
+            QString label;
+            int value = 0, max = 0;
+            in >> reply >> jobId;
+            if (reply == "progress") {
+                in >> label >> value >> max;
+            }
+            else if (reply == "finished") {
+                in >> ok >> label;
+            }
+            if (!in.commitTransaction()) {
+                break; // Wait for the rest of the reply
+            }
+
+            if (reply == "progress") {
+                std::cout << label.toStdString() << " " << value << "/" << max << std::endl;
+            }
+            else if (reply == "finished") {
+                std::cout << label.toStdString() << std::endl;
+                return ok ? 0 : 1;
+            }
+        }
+    }
+
+    std::cerr << "The daemon closed the connection" << std::endl;
+    return 1;
+}
+
+/// Stacks a time-lapse series, every folder holds the frames of one stack
+/// \param outputFolder The folder the results are written to, one <stack folder name>.png per stack
+/// \param settingsFile A parameter file saved by the application, or - for the defaults
+/// \param folders The stack folders in capture order, the images of a folder are stacked in name order
+/// \param config The thread counts of the pipeline stages
+/// \return The exit code
+static int series(const QString &outputFolder, const QString &settingsFile, const QStringList &folders, const PipelineConfig &config)
+{
+    bool ok = false;
+    QMap<QString, QVariant> params = loadParameters(settingsFile, ok);
+    if (!ok) {
+        return 1;
+    }
+    if (!QDir().mkpath(outputFolder)) {
+        std::cerr << "Could not create " << outputFolder.toStdString() << std::endl;
+        return 1;
+    }
+
+    std::vector<QStringList> stacks;
+    QStringList outputs;
+    for (const QString &path : folders) {
+        QDir folder(path);
+        QStringList files;
+        for (const QString &entry : folder.entryList(QStringList() << "*.png" << "*.jpg" << "*.jpeg" << "*.bmp" << "*.tif" << "*.tiff", QDir::Files, QDir::Name)) {
+            files << folder.absoluteFilePath(entry);
+        }
+        if (files.isEmpty()) {
+            std::cerr << "No images in " << path.toStdString() << ", skipping it" << std::endl;
+            continue;
+        }
+        stacks.push_back(files);
+        outputs << QDir(outputFolder).absoluteFilePath(QFileInfo(folder.absolutePath()).fileName() + ".png");
+    }
+
+    ImageProcessing processor;
+    processor.set_pipeline_config(config);
+    int written = processor.stack_series(stacks, JobRunner::stackParameters(params), [&](int index, const cv::Mat &composite) {
+        if (composite.empty() || !cv::imwrite(outputs[index].toStdString(), composite)) {
+            std::cerr << "Could not write " << outputs[index].toStdString() << std::endl;
+            return false;
+        }
+        std::cout << outputs[index].toStdString() << std::endl;
+        return true;
+    });
+    return written == static_cast<int>(stacks.size()) && !stacks.empty() ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QString name = StackDaemon::DefaultName;
+    size_t cacheMegabytes = 2048;
+    QStringList outputFolders;
+    PipelineConfig pipelineConfig = PipelineConfig::defaults();
+    QStringList args = a.arguments().mid(1);
+    while (!args.isEmpty() && args.first().startsWith("--")) {
+        QString option = args.takeFirst();
+        if (option == "--name" && !args.isEmpty()) {
+            name = args.takeFirst();
+        }
+        else if (option == "--cache-mb" && !args.isEmpty()) {
+            cacheMegabytes = args.takeFirst().toULongLong();
+        }
+        else if (option == "--pipeline" && !args.isEmpty() && parsePipelineConfig(args.first(), pipelineConfig)) {
+            args.removeFirst();
+        }
+        else if (option == "--output-dir" && !args.isEmpty()) {
+            outputFolders << QFileInfo(args.takeFirst()).absoluteFilePath();
+        }
+        else if (option == "--submit" && args.size() >= 3) {
+            return submit(name, args[0], args[1], args.mid(2));
+        }
+        else if (option == "--shard" && args.size() >= 4) {
+            bool ok = false;
+            QMap<QString, QVariant> params = loadParameters(args[2], ok);
+            if (!ok) {
+                return 1;
+            }
+            QStringList files;
+            for (const QString &file : args.mid(3)) {
+                files << QFileInfo(file).absoluteFilePath();
+            }
+            ShardCoordinator coordinator(args[0].toInt());
+            return coordinator.run(files, params, QFileInfo(args[1]).absoluteFilePath());
+        }
+        else if (option == "--series" && args.size() >= 3) {
+            return series(args[0], args[1], args.mid(2), pipelineConfig);
+        }
+        else {
+            std::cerr << "Usage: focuspocus_daemon [--name <socket>] [--cache-mb <size>] [--output-dir <folder>...] [--pipeline <decode>,<align>,<score>,<queue>]" << std::endl
+                      << "       focuspocus_daemon [--name <socket>] --submit <output> <settings file|-> <images...>" << std::endl
+                      << "       focuspocus_daemon --shard <workers> <output> <settings file|-> <images...>" << std::endl
+                      << "       focuspocus_daemon [--pipeline ...] --series <output folder> <settings file|-> <stack folders...>" << std::endl;
+            return 1;
+        }
+    }
+
+    StackDaemon daemon(cacheMegabytes * 1024 * 1024, pipelineConfig);
+    if (!outputFolders.isEmpty()) {
+        daemon.setOutputFolders(outputFolders);
+    }
+    if (!daemon.listen(name)) {
+        return 1;
+    }
+    return a.exec();
+}
@@ -0,0 +1,222 @@
+/****************************************************************************
+** File Name:   shardcoordinator.cpp
+**
+** Description:
+**     This file contains the implementation of the ShardCoordinator class,
+**     which splits one large stack into strips, has them stacked by worker
+**     daemon processes and stitches the strips into the result.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "shardcoordinator.h"
+#include "stackdaemon.h"
+#include <settings.h>
+#include <framesource.h>
+#include <imageprocessing.h>
+#include <opencv2/imgcodecs.hpp>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QFile>
+#include <iostream>
+
+ShardCoordinator::ShardCoordinator(int workerCount)
+    : workerCount(std::max(1, workerCount))
+{}
+
+ShardCoordinator::~ShardCoordinator()
+{
+    stopWorkers();
+}
+
+/// Starts the worker daemons and connects to them. Workers get no decode cache, a shard
+/// decodes every frame once and only keeps its strip of it.
+/// \return False if a worker could not be started or did not start listening
+bool ShardCoordinator::startWorkers() {
+    for (int i = 0; i < workerCount; i++) {
+        QString name = QString("focuspocus-shard-%1-%2").arg(QCoreApplication::applicationPid()).arg(i);
+        Worker worker;
+        worker.process.reset(new QProcess());
+        worker.process->setProcessChannelMode(QProcess::ForwardedChannels);
+        worker.process->start(QCoreApplication::applicationFilePath(), QStringList() << "--name" << name << "--cache-mb" << "0");
+        if (!worker.process->waitForStarted()) {
+            std::cerr << "Could not start worker " << i << std::endl;
+            return false;
+        }
+
+        //The worker needs a moment before it listens
+        worker.socket.reset(new QLocalSocket());
+        for (int attempt = 0; attempt < 100 && worker.socket->state() != QLocalSocket::ConnectedState; attempt++) {
+            worker.socket->connectToServer(name);
+            if (!worker.socket->waitForConnected(100)) {
+                QThread::msleep(50);
+            }
+        }
+        if (worker.socket->state() != QLocalSocket::ConnectedState) {
+            std::cerr << "Could not connect to worker " << i << std::endl;
+            return false;
+        }
+        workers.push_back(std::move(worker));
+    }
+    return true;
+}
+
+/// Disconnects from the workers and ends their processes
+void ShardCoordinator::stopWorkers() {
+    for (Worker &worker : workers) {
+        if (worker.socket) {
+            worker.socket->disconnectFromServer();
+        }
+        if (worker.process && worker.process->state() != QProcess::NotRunning) {
+            worker.process->terminate();
+            if (!worker.process->waitForFinished(3000)) {
+                worker.process->kill();
+                worker.process->waitForFinished();
+            }
+        }
+    }
+    workers.clear();
+}
+
+/// Splits the frame area into horizontal strips. Strips start and end on the depth map grid, so that
+/// a strip scores the same depth pixels as a stack of the whole frame would. The smoothing sees only
+/// the strip and its halo, so the depth map can still differ slightly from the whole frame near seams.
+/// \param frameSize The size of the frames
+/// \param count The number of strips
+/// \param depthScale The depth map resolution divisor
+/// \return The strips, without their halo
+std::vector<cv::Rect> ShardCoordinator::splitFrame(const cv::Size &frameSize, int count, int depthScale) {
+    int stripHeight = (frameSize.height + count - 1) / count;
+    stripHeight = std::max(depthScale, (stripHeight + depthScale - 1) / depthScale * depthScale);
+
+    std::vector<cv::Rect> strips;
+    for (int top = 0; top < frameSize.height; top += stripHeight) {
+        strips.emplace_back(0, top, frameSize.width, std::min(stripHeight, frameSize.height - top));
+    }
+    return strips;
+}
+
+/// Aligns the frames once, has the workers stack one strip each at a time and stitches the strips
+/// \param files The image files
+/// \param params The parameters with the settings keys
+/// \param output The file the result is written to
+/// \return The exit code
+int ShardCoordinator::run(const QStringList &files, const QMap<QString, QVariant> &params, const QString &output) {
+    StackParameters stackParams = JobRunner::stackParameters(params);
+
+    //Alignment needs the whole frames and is done once, the workers only warp with the transforms
+    cv::Size frameSize;
+    std::vector<cv::Mat> transforms;
+    {
+        ImageProcessing processor;
+        ImageFileSource source(files);
+        transforms = processor.align_frames(source, stackParams, &frameSize);
+    }
+    if (frameSize.empty() || transforms.size() != static_cast<size_t>(files.size())) {
+        std::cerr << "Images could not be aligned." << std::endl;
+        return 1;
+    }
+
+    QTemporaryDir shardDir;
+    if (!shardDir.isValid() || !startWorkers()) {
+        return 1;
+    }
+
+    //More strips than workers, so that a worker that finishes early takes another one. The workers read
+    //the depth scale from the same parameters, stack_region keeps their areas on the same grid
+    std::vector<cv::Rect> shards = splitFrame(frameSize, workerCount * 2, std::max(1, stackParams.depthScale));
+    cv::Mat result;
+    size_t nextShard = 0;
+    size_t finishedShards = 0;
+    std::cout << "Stacking " << shards.size() << " shards with " << workers.size() << " workers" << std::endl;
+
+    while (finishedShards < shards.size()) {
+        for (Worker &worker : workers) {
+            if (worker.shard >= 0 || nextShard >= shards.size()) {
+                continue;
+            }
+            const cv::Rect &shard = shards[nextShard];
+            QDataStream out(worker.socket.get());
+            out << QString("shard") << files;
+            JobRunner::writeTransforms(out, transforms);
+            out << QRect(shard.x, shard.y, shard.width, shard.height);
+            Settings::writeParameters(out, params);
+            out << shardDir.filePath(QString("shard_%1.tif").arg(nextShard));
+            worker.socket->flush();
+            worker.shard = static_cast<int>(nextShard++);
+        }
+
+        for (Worker &worker : workers) {
+            if (worker.shard < 0) {
+                continue;
+            }
+            if (worker.socket->state() != QLocalSocket::ConnectedState) {
+                std::cerr << "A worker stopped while stacking shard " << worker.shard << std::endl;
+                return 1;
+            }
+            if (worker.socket->bytesAvailable() == 0 && !worker.socket->waitForReadyRead(50)) {
+                continue;
+            }
+
+            QDataStream in(worker.socket.get());
+            while (worker.socket->bytesAvailable() > 0 && worker.shard >= 0) {
+                in.startTransaction();
+                QString reply;
+                quint32 jobId = 0;
+                QString label;
+                int value = 0, max = 0;
+                bool ok = false;
+                in >> reply >> jobId;
+                if (reply == "progress") {
+                    in >> label >> value >> max;
+                }
+                else if (reply == "finished") {
+                    in >> ok >> label;
+                }
+                if (!in.commitTransaction()) {
+                    break; // Wait for the rest of the reply
+                }
+                if (reply != "finished") {
+                    continue;
+                }
+                if (!ok) {
+                    std::cerr << "Shard " << worker.shard << " failed: " << label.toStdString() << std::endl;
+                    return 1;
+                }
+
+                //Stitch the strip into the result, strips do not overlap once their halo is cut off
+                cv::Mat strip = cv::imread(label.toStdString(), cv::IMREAD_UNCHANGED);
+                const cv::Rect &shard = shards[worker.shard];
+                if (strip.size() != shard.size()) {
+                    std::cerr << "Shard " << worker.shard << " has the wrong size" << std::endl;
+                    return 1;
+                }
+                if (result.empty()) {
+                    result.create(frameSize, strip.type());
+                }
+                strip.copyTo(result(shard));
+                QFile::remove(label);
+
+                std::cout << "Stitched shard " << ++finishedShards << "/" << shards.size() << std::endl;
+                worker.shard = -1;
+            }
+        }
+    }
+    stopWorkers();
+
+    if (!cv::imwrite(output.toStdString(), result)) {
+        std::cerr << "Could not write " << output.toStdString() << std::endl;
+        return 1;
+    }
+    std::cout << output.toStdString() << std::endl;
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef SHARDCOORDINATOR_H
+#define SHARDCOORDINATOR_H
+
+#include <QStringList>
+#include <QMap>
+#include <QVariant>
+#include <QProcess>
+#include <QLocalSocket>
+#include <opencv2/core/core.hpp>
+#include <memory>
+#include <vector>
+
+/// Stacks one large stack with several worker processes. The frames are aligned once by the
+/// coordinator, the frame area is split into strips and every strip is stacked by a worker
+/// daemon with the halo its kernels need. Each worker only holds its own strip of every layer.
+class ShardCoordinator
+{
+public:
+    explicit ShardCoordinator(int workerCount);
+    ~ShardCoordinator();
+
+    // Stacks the files and writes the stitched result, returns the exit code
+    int run(const QStringList &files, const QMap<QString, QVariant> &params, const QString &output);
+
+private:
+    struct Worker {
+        std::unique_ptr<QProcess> process;
+        std::unique_ptr<QLocalSocket> socket;
+        int shard = -1; // The shard being stacked, -1 while idle
+    };
+
+    int workerCount;
+    std::vector<Worker> workers;
+
+    bool startWorkers();
+    void stopWorkers();
+    static std::vector<cv::Rect> splitFrame(const cv::Size &frameSize, int count, int depthScale);
+};
+
+#endif // SHARDCOORDINATOR_H
@@ -0,0 +1,346 @@
+/****************************************************************************
+** File Name:   stackdaemon.cpp
+**
+** Description:
+**     This file contains the implementation of the stacking daemon, a long
+**     lived process that accepts stack jobs over a local socket and keeps
+**     its caches warm between jobs.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "stackdaemon.h"
+#include <settings.h>
+#include <opencv2/imgcodecs.hpp>
+#include <QDataStream>
+#include <QDir>
+#include <QFileInfo>
+#include <iostream>
+
+const char *StackDaemon::DefaultName = "focuspocus";
+
+JobRunner::JobRunner(size_t cacheBytes, const PipelineConfig &config, QObject *parent)
+    : QObject{parent}
+    , decodeCache(cacheBytes)
+{
+    processor.set_pipeline_config(config);
+
+    //The processor reports from its pipeline threads, the report is queued to the daemon thread
+    connect(&processor, &ImageProcessing::progress, this, [this](QString label, int value, int max) {
+        emit progress(currentJob, label, value, max);
+    }, Qt::DirectConnection);
+}
+
+/// Converts parameters stored with the settings keys to stacking parameters. Slab size is not
+/// used, jobs are always stacked in one pass so that their alignment can be cached.
+/// \param params The parameters
+/// \return The stacking parameters
+StackParameters JobRunner::stackParameters(const QMap<QString, QVariant> &params) {
+    StackParameters stackParams;
+    stackParams.laplaceKernelSize = params.value("Laplacian Kernel size", stackParams.laplaceKernelSize).toInt();
+    stackParams.smoothKernelSize = params.value("Smooth Kernel size", stackParams.smoothKernelSize).toInt();
+    stackParams.smoothStrength = params.value("Smooth strength", stackParams.smoothStrength).toInt();
+    stackParams.smoothIterations = params.value("Smooth iterations", stackParams.smoothIterations).toInt();
+    stackParams.blendLayers = params.value("Blend layers", stackParams.blendLayers).toBool();
+    stackParams.depthScale = params.value("Depth resolution", stackParams.depthScale).toInt();
+    stackParams.pruneLayers = params.value("Prune layers", stackParams.pruneLayers).toBool();
+    stackParams.deferredWarp = params.value("Deferred warping", stackParams.deferredWarp).toBool();
+    stackParams.translationFirst = params.value("Fast alignment", stackParams.translationFirst).toBool();
+    return stackParams;
+}
+
+/// Writes alignment transforms to a stream
+/// \param out The stream
+/// \param transforms The 2x3 transforms, empty for frames that could not be aligned
+void JobRunner::writeTransforms(QDataStream &out, const std::vector<cv::Mat> &transforms) {
+    out << quint32(transforms.size());
+    for (const cv::Mat &transform : transforms) {
+        cv::Mat values;
+        if (!transform.empty()) {
+            transform.convertTo(values, CV_64F);
+        }
+        out << quint8(values.empty() ? 0 : 1);
+        for (int r = 0; r < values.rows; r++) {
+            for (int c = 0; c < values.cols; c++) {
+                out << values.at<double>(r, c);
+            }
+        }
+    }
+}
+
+/// Reads alignment transforms from a stream
+/// \param in The stream
+/// \return The 2x3 transforms, empty for frames that could not be aligned
+std::vector<cv::Mat> JobRunner::readTransforms(QDataStream &in) {
+    quint32 count = 0;
+    in >> count;
+    std::vector<cv::Mat> transforms;
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        quint8 hasTransform = 0;
+        in >> hasTransform;
+        cv::Mat transform;
+        if (hasTransform) {
+            transform.create(2, 3, CV_64F);
+            for (int r = 0; r < 2; r++) {
+                for (int c = 0; c < 3; c++) {
+                    in >> transform.at<double>(r, c);
+                }
+            }
+        }
+        transforms.push_back(transform);
+    }
+    return transforms;
+}
+
+/// Builds the key of the alignment of a stack. A file that was replaced since it was aligned has
+/// another size or modification time, and the alignment mode changes the transforms.
+/// \param files The image files
+/// \param params The stacking parameters
+/// \return The key
+QString JobRunner::transformKey(const QStringList &files, const StackParameters &params) {
+    QStringList parts;
+    parts << QString("fast=%1").arg(params.translationFirst ? 1 : 0);
+    for (const QString &file : files) {
+        parts << DecodeCache::key(file);
+    }
+    return parts.join('\n');
+}
+
+/// Stacks a job and writes the result. Frames are decoded through the decode cache and the
+/// alignment of unchanged files that have been stacked before with the same alignment mode is reused.
+/// \param jobId The job id
+/// \param files The image files
+/// \param params The parameters with the settings keys
+/// \param outputPath The file the result is written to
+void JobRunner::run(quint32 jobId, const QStringList &files, const QMap<QString, QVariant> &params, const QString &outputPath) {
+    currentJob = jobId;
+    StackParameters stackParams = stackParameters(params);
+
+    //Pruned runs leave out layers, their alignment is not valid for other parameters
+    QString key = transformKey(files, stackParams);
+    std::vector<cv::Mat> transforms = transformCache.value(key);
+
+    CachedImageSource source(files, decodeCache);
+    cv::Mat result = processor.stack_frames(source, stackParams, &transforms);
+    if (!stackParams.pruneLayers) {
+        transformCache[key] = transforms;
+    }
+
+    std::cout << "Job " << jobId << ": " << files.size() << " files, decode cache "
+              << decodeCache.hits() << " hits / " << decodeCache.misses() << " misses" << std::endl;
+
+    if (result.empty()) {
+        emit finished(jobId, false, "Images could not be stacked.");
+        return;
+    }
+    if (!cv::imwrite(outputPath.toStdString(), result)) {
+        emit finished(jobId, false, "Could not write " + outputPath);
+        return;
+    }
+    emit finished(jobId, true, outputPath);
+}
+
+/// Stacks one shard of a stack that was split by a coordinator. The frames are warped with the
+/// transforms of the coordinator and the region is stacked with the halo its kernels need.
+/// \param jobId The job id
+/// \param files The image files
+/// \param transforms The per frame transforms
+/// \param region The region of the frames to stack
+/// \param params The parameters with the settings keys
+/// \param outputPath The file the region is written to
+void JobRunner::runShard(quint32 jobId, const QStringList &files, const std::vector<cv::Mat> &transforms, const QRect &region, const QMap<QString, QVariant> &params, const QString &outputPath) {
+    currentJob = jobId;
+    cv::Rect roi(region.x(), region.y(), region.width(), region.height());
+    cv::Mat result = processor.stack_region(files, transforms, roi, stackParameters(params), false);
+
+    if (result.empty() || roi != cv::Rect(region.x(), region.y(), region.width(), region.height())) {
+        emit finished(jobId, false, "The shard could not be stacked.");
+        return;
+    }
+    if (!cv::imwrite(outputPath.toStdString(), result)) {
+        emit finished(jobId, false, "Could not write " + outputPath);
+        return;
+    }
+    emit finished(jobId, true, outputPath);
+}
+
+StackDaemon::StackDaemon(size_t cacheBytes, const PipelineConfig &config, QObject *parent)
+    : QObject{parent}
+    , runner(new JobRunner(cacheBytes, config))
+{
+    qRegisterMetaType<std::vector<cv::Mat>>("std::vector<cv::Mat>");
+
+    //Jobs run one at a time on the worker thread, the server stays responsive meanwhile
+    runner->moveToThread(&workerThread);
+    connect(&workerThread, &QThread::finished, runner, &QObject::deleteLater);
+    connect(this, &StackDaemon::runJob, runner, &JobRunner::run);
+    connect(this, &StackDaemon::runShard, runner, &JobRunner::runShard);
+    connect(runner, &JobRunner::progress, this, &StackDaemon::jobProgress);
+    connect(runner, &JobRunner::finished, this, &StackDaemon::jobFinished);
+    connect(&server, &QLocalServer::newConnection, this, &StackDaemon::newConnection);
+    workerThread.start();
+
+    outputFolders << QDir::homePath() << QDir::tempPath();
+}
+
+StackDaemon::~StackDaemon()
+{
+    workerThread.quit();
+    workerThread.wait();
+}
+
+/// Starts listening on a local socket that only the user of the daemon can connect to. A socket
+/// that another daemon still answers on is left alone, only a stale one is removed.
+/// \param name The socket name
+/// \return False if the socket could not be created or is in use
+bool StackDaemon::listen(const QString &name) {
+    QLocalSocket probe;
+    probe.connectToServer(name);
+    if (probe.waitForConnected(500)) {
+        std::cerr << "A daemon is already listening on " << name.toStdString() << std::endl;
+        return false;
+    }
+    QLocalServer::removeServer(name);
+
+    server.setSocketOptions(QLocalServer::UserAccessOption);
+    if (!server.listen(name)) {
+        std::cerr << "Could not listen on " << name.toStdString() << ": " << server.errorString().toStdString() << std::endl;
+        return false;
+    }
+    std::cout << "Listening on " << server.fullServerName().toStdString() << std::endl;
+    return true;
+}
+
+/// Sets the folders results may be written to
+/// \param folders The folders, results may also go to their subfolders
+void StackDaemon::setOutputFolders(const QStringList &folders) {
+    outputFolders = folders;
+}
+
+/// Checks that a job may write its result to a path. Results are written with the rights of the
+/// daemon, so they only go to new files inside the output folders.
+/// \param path The output path of the job
+/// \param reason Set to the reason a path is rejected
+/// \return True if the path can be written
+bool StackDaemon::acceptOutputPath(const QString &path, QString &reason) const {
+    QFileInfo info(path);
+    if (path.isEmpty() || !info.isAbsolute()) {
+        reason = "The output path must be absolute.";
+        return false;
+    }
+    if (info.exists() || info.isSymLink() || pendingOutputs.contains(info.absoluteFilePath())) {
+        reason = path + " already exists.";
+        return false;
+    }
+    QString folder = QFileInfo(info.absolutePath()).canonicalFilePath();
+    if (folder.isEmpty()) {
+        reason = "The folder of " + path + " does not exist.";
+        return false;
+    }
+    for (const QString &allowed : outputFolders) {
+        QString root = QFileInfo(allowed).canonicalFilePath();
+        if (!root.isEmpty() && (folder == root || folder.startsWith(root.endsWith('/') ? root : root + '/'))) {
+            return true;
+        }
+    }
+    reason = path + " is outside the output folders of the daemon.";
+    return false;
+}
+
+/// Accepts the pending client connections
+void StackDaemon::newConnection() {
+    while (QLocalSocket *socket = server.nextPendingConnection()) {
+        connect(socket, &QLocalSocket::readyRead, this, [this, socket]() { readRequest(socket); });
+        connect(socket, &QLocalSocket::disconnected, this, [this, socket]() {
+            //Jobs of a client that went away still run, their results are only written to disk
+            for (auto job = jobClients.begin(); job != jobClients.end(); ++job) {
+                if (job.value() == socket) {
+                    job.value() = nullptr;
+                }
+            }
+            socket->deleteLater();
+        });
+    }
+}
+
+/// Reads the complete requests a client has sent and queues their jobs
+/// \param socket The client socket
+void StackDaemon::readRequest(QLocalSocket *socket) {
+    QDataStream in(socket);
+    while (socket->bytesAvailable() > 0) {
+        in.startTransaction();
+        QString command;
+        QStringList files;
+        std::vector<cv::Mat> transforms;
+        QRect region;
+        QString outputPath;
+        in >> command >> files;
+        if (command == "shard") {
+            transforms = JobRunner::readTransforms(in);
+            in >> region;
+        }
+        QMap<QString, QVariant> params = Settings::readParameters(in);
+        in >> outputPath;
+        if (!in.commitTransaction()) {
+            return; // Wait for the rest of the request
+        }
+
+        if ((command != "stack" && command != "shard") || files.isEmpty()) {
+            std::cerr << "Ignoring invalid request" << std::endl;
+            continue;
+        }
+
+        quint32 jobId = nextJobId++;
+        QDataStream out(socket);
+        QString reason;
+        if (!acceptOutputPath(outputPath, reason)) {
+            std::cerr << "Rejecting job " << jobId << ": " << reason.toStdString() << std::endl;
+            out << QString("finished") << jobId << false << reason;
+            continue;
+        }
+        jobClients[jobId] = socket;
+        jobOutputs[jobId] = QFileInfo(outputPath).absoluteFilePath();
+        pendingOutputs.insert(jobOutputs[jobId]);
+        out << QString("accepted") << jobId;
+        if (command == "shard") {
+            emit runShard(jobId, files, transforms, region, params, outputPath);
+        }
+        else {
+            emit runJob(jobId, files, params, outputPath);
+        }
+    }
+}
+
+/// Forwards the progress of a job to its client
+/// \param jobId The job id
+/// \param label The progress label
+/// \param value The progress value
+/// \param max The progress maximum
+void StackDaemon::jobProgress(quint32 jobId, QString label, int value, int max) {
+    QLocalSocket *socket = jobClients.value(jobId);
+    if (socket != nullptr) {
+        QDataStream out(socket);
+        out << QString("progress") << jobId << label << value << max;
+    }
+}
+
+/// Sends the result of a job to its client
+/// \param jobId The job id
+/// \param ok Whether the job succeeded
+/// \param message The output path, or the error if the job failed
+void StackDaemon::jobFinished(quint32 jobId, bool ok, QString message) {
+    pendingOutputs.remove(jobOutputs.take(jobId));
+    QLocalSocket *socket = jobClients.take(jobId);
+    if (socket != nullptr) {
+        QDataStream out(socket);
+        out << QString("finished") << jobId << ok << message;
+    }
+    std::cout << "Job " << jobId << (ok ? " finished: " : " failed: ") << message.toStdString() << std::endl;
+}
@@ -0,0 +1,98 @@
+#ifndef STACKDAEMON_H
+#define STACKDAEMON_H
+
+#include <QObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMap>
+#include <QSet>
+#include <QVariant>
+#include <QThread>
+#include <QDataStream>
+#include <QRect>
+#include <imageprocessing.h>
+#include "decodecache.h"
+
+/// Runs stack jobs one after another. Lives on its own thread and keeps the image processor,
+/// the decode cache and the alignment of earlier jobs between jobs.
+class JobRunner : public QObject
+{
+    Q_OBJECT
+public:
+    explicit JobRunner(size_t cacheBytes, const PipelineConfig &config, QObject *parent = nullptr);
+
+    // Converts parameters stored with the settings keys to stacking parameters
+    static StackParameters stackParameters(const QMap<QString, QVariant> &params);
+
+    // Writes alignment transforms to a stream, empty transforms are kept
+    static void writeTransforms(QDataStream &out, const std::vector<cv::Mat> &transforms);
+
+    // Reads alignment transforms written by writeTransforms
+    static std::vector<cv::Mat> readTransforms(QDataStream &in);
+
+    // Builds the key of the alignment of a stack from its files and the alignment parameters
+    static QString transformKey(const QStringList &files, const StackParameters &params);
+
+private:
+    ImageProcessing processor;
+    DecodeCache decodeCache;
+    QMap<QString, std::vector<cv::Mat>> transformCache; // Keyed by transformKey
+    quint32 currentJob = 0;
+
+public slots:
+    void run(quint32 jobId, const QStringList &files, const QMap<QString, QVariant> &params, const QString &outputPath);
+    void runShard(quint32 jobId, const QStringList &files, const std::vector<cv::Mat> &transforms, const QRect &region, const QMap<QString, QVariant> &params, const QString &outputPath);
+
+signals:
+    void progress(quint32 jobId, QString label, int value, int max);
+    void finished(quint32 jobId, bool ok, QString message);
+};
+
+/// Accepts stack jobs from local clients and streams progress and results back to them.
+/// Messages are QDataStream records starting with a command string:
+///   client: "stack", files (QStringList), parameters (see Settings::writeParameters), output path
+///           "shard", files, transforms (see JobRunner::writeTransforms), region (QRect), parameters, output path
+///   daemon: "accepted", job id
+///           "progress", job id, label, value, max
+///           "finished", job id, ok, output path or error message
+/// A job whose output path already exists or lies outside the output folders is answered with
+/// "finished" and an error right away.
+class StackDaemon : public QObject
+{
+    Q_OBJECT
+public:
+    static const char *DefaultName;
+
+    explicit StackDaemon(size_t cacheBytes, const PipelineConfig &config = PipelineConfig::defaults(), QObject *parent = nullptr);
+    ~StackDaemon();
+
+    // Starts listening on a local socket of this user, an old socket left by a crashed daemon is removed
+    bool listen(const QString &name);
+
+    // Sets the folders results may be written to, the home and temporary folders by default
+    void setOutputFolders(const QStringList &folders);
+
+private slots:
+    void newConnection();
+    void readRequest(QLocalSocket *socket);
+    void jobProgress(quint32 jobId, QString label, int value, int max);
+    void jobFinished(quint32 jobId, bool ok, QString message);
+
+signals:
+    void runJob(quint32 jobId, const QStringList &files, const QMap<QString, QVariant> &params, const QString &outputPath);
+    void runShard(quint32 jobId, const QStringList &files, const std::vector<cv::Mat> &transforms, const QRect &region, const QMap<QString, QVariant> &params, const QString &outputPath);
+
+private:
+    QLocalServer server;
+    QThread workerThread;
+    JobRunner *runner;
+    QMap<quint32, QLocalSocket *> jobClients;
+    QMap<quint32, QString> jobOutputs;
+    QSet<QString> pendingOutputs; // Output paths of the queued and running jobs
+    QStringList outputFolders;
+    quint32 nextJobId = 1;
+
+    bool acceptOutputPath(const QString &path, QString &reason) const;
+};
+
+#endif // STACKDAEMON_H
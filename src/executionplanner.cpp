@@ -0,0 +1,445 @@
+/****************************************************************************
+** File Name:   executionplanner.cpp
+**
+** Description:
+**     This file contains the implementation of the ExecutionPlanner class,
+**     which reads the size of a stack from its file headers and picks how
+**     the stack is processed from a cost model of the stages and the memory
+**     and cores of the machine.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "executionplanner.h"
+#include <opencv2/imgcodecs.hpp>
+#include <QtGlobal>
+#include <QByteArray>
+#include <QFile>
+#include <QSettings>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+
+#if defined(Q_OS_WIN)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(Q_OS_UNIX)
+#include <unistd.h>
+#endif
+
+//Seconds per megapixel on one core, measured on a reference machine. The calibration scales them to this one.
+static const double DecodeCost = 0.02;       // Per frame
+static const double FeatureAlignCost = 0.25; // Per frame, SIFT detection and matching
+static const double PhaseAlignCost = 0.04;   // Per frame, phase correlation of a frame that is only shifted
+static const double WarpCost = 0.03;         // Per frame, cubic warp of a color frame
+static const double ScoreCost = 0.05;        // Per frame, per megapixel of the depth map
+static const double ReduceCost = 0.005;      // Per frame, area resize to the depth resolution
+static const double SmoothCost = 0.0004;     // Per pass, per megapixel of the depth map and per kernel cell
+static const double UpsampleCost = 0.04;     // Joint bilateral upsampling of the depth map
+static const double BlendCost = 0.03;        // Composite from warped layers, one pixel at a time
+static const double AccumulateCost = 0.003;  // Per layer, adding a layer to a composite accumulator
+
+//A tile of the composite usually spans a few neighbouring layers of the depth map
+static const int LayersPerTile = 4;
+
+/// Returns how many cores worth of work a parallel loop gets done
+/// \param threads The number of threads
+/// \return The speedup over one thread
+static double speedup(int threads) {
+    return 1.0 + 0.8 * (std::max(1, threads) - 1);
+}
+
+/// Reads a big endian number
+/// \param data The bytes
+/// \param offset The offset of the number
+/// \param bytes The size of the number
+/// \return The number
+static quint32 readBigEndian(const QByteArray& data, int offset, int bytes) {
+    quint32 value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | static_cast<quint8>(data[offset + i]);
+    }
+    return value;
+}
+
+/// Reads a little endian number
+/// \param data The bytes
+/// \param offset The offset of the number
+/// \param bytes The size of the number
+/// \return The number
+static quint32 readLittleEndian(const QByteArray& data, int offset, int bytes) {
+    quint32 value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | static_cast<quint8>(data[offset + i]);
+    }
+    return value;
+}
+
+/// Finds the memory that can be used and the number of cores
+/// \return The machine resources
+MachineResources MachineResources::detect() {
+    MachineResources machine;
+    machine.cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+#if defined(Q_OS_WIN)
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status)) {
+        machine.availableBytes = static_cast<size_t>(status.ullAvailPhys);
+    }
+#elif defined(Q_OS_LINUX)
+    //MemAvailable counts the page cache that can be dropped, MemFree does not
+    QFile meminfo("/proc/meminfo");
+    if (meminfo.open(QIODevice::ReadOnly)) {
+        for (const QByteArray& line : meminfo.readAll().split('\n')) {
+            if (line.startsWith("MemAvailable:")) {
+                machine.availableBytes = static_cast<size_t>(line.mid(13).trimmed().split(' ').first().toULongLong()) * 1024;
+            }
+        }
+    }
+#elif defined(Q_OS_UNIX)
+    //Without a cheap figure of the free memory, assume that half of the physical memory is free
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && pageSize > 0) {
+        machine.availableBytes = static_cast<size_t>(pages) * static_cast<size_t>(pageSize) / 2;
+    }
+#endif
+
+    if (machine.availableBytes == 0) {
+        machine.availableBytes = size_t(4) * 1024 * 1024 * 1024;
+    }
+    return machine;
+}
+
+/// Sets the parameters of a run to the plan
+/// \param params The parameters chosen by the user
+/// \return The parameters of the run
+StackParameters ExecutionPlan::apply(const StackParameters& params) const {
+    StackParameters planned = params;
+    planned.depthScale = depthScale;
+    planned.deferredWarp = memoryMode == MemoryMode::Tiled;
+    planned.tileSize = tileSize;
+    return planned;
+}
+
+/// Describes the plan for the log
+/// \return The plan and its predicted time
+QString ExecutionPlan::describe() const {
+    QString mode = memoryMode == MemoryMode::InMemory ? "in memory" : (memoryMode == MemoryMode::Tiled ? QString("tiled %1 px").arg(tileSize) : "out of core");
+    return QString("Plan: %1, depth at 1/%2 resolution, threads %3 decode %4 align %5 score %6 OpenCV, %7 MB%8. "
+                   "Predicted %9 s (pipeline %10 s, depth map %11 s, composite %12 s)")
+        .arg(mode)
+        .arg(depthScale)
+        .arg(config.decodeThreads)
+        .arg(config.alignThreads)
+        .arg(config.scoreThreads)
+        .arg(config.opencvThreads)
+        .arg(predictedBytes / (1024.0 * 1024.0), 0, 'f', 0)
+        .arg(fitsMemory ? "" : ", more than the available memory")
+        .arg(predicted.total(), 0, 'f', 1)
+        .arg(predicted.pipeline, 0, 'f', 1)
+        .arg(predicted.depthMap, 0, 'f', 1)
+        .arg(predicted.composite, 0, 'f', 1);
+}
+
+/// Loads the calibration of the earlier runs
+ExecutionPlanner::ExecutionPlanner() {
+    QSettings settings("FocusPocus", "FocusPocus");
+    calibration.pipeline = settings.value("Planner/pipeline", 1.0).toDouble();
+    calibration.depthMap = settings.value("Planner/depthMap", 1.0).toDouble();
+    calibration.composite = settings.value("Planner/composite", 1.0).toDouble();
+}
+
+/// Reads the image size of a PNG, JPEG, BMP or TIFF file from its header
+/// \param file The image file
+/// \param size Receives the image size
+/// \return False if the file is missing or its format is not known
+bool ExecutionPlanner::readImageSize(const QString& file, cv::Size& size) {
+    QFile in(file);
+    if (!in.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QByteArray header = in.read(32);
+
+    //PNG, the IHDR chunk comes first
+    if (header.size() >= 24 && header.startsWith("\x89PNG")) {
+        size = cv::Size(readBigEndian(header, 16, 4), readBigEndian(header, 20, 4));
+        return !size.empty();
+    }
+
+    //BMP, a negative height stores the rows top down
+    if (header.size() >= 26 && header.startsWith("BM")) {
+        size = cv::Size(static_cast<qint32>(readLittleEndian(header, 18, 4)), std::abs(static_cast<qint32>(readLittleEndian(header, 22, 4))));
+        return !size.empty();
+    }
+
+    //JPEG, the size is in the start of frame segment, which may come after the EXIF data
+    if (header.size() >= 4 && static_cast<quint8>(header[0]) == 0xFF && static_cast<quint8>(header[1]) == 0xD8) {
+        qint64 position = 2;
+        while (in.seek(position)) {
+            QByteArray segment = in.read(9);
+            if (segment.size() < 4 || static_cast<quint8>(segment[0]) != 0xFF) {
+                return false;
+            }
+            quint8 marker = static_cast<quint8>(segment[1]);
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                if (segment.size() < 9) {
+                    return false;
+                }
+                size = cv::Size(readBigEndian(segment, 7, 2), readBigEndian(segment, 5, 2));
+                return !size.empty();
+            }
+            position += 2 + readBigEndian(segment, 2, 2);
+        }
+        return false;
+    }
+
+    //TIFF, the size is in the first image directory
+    bool little = header.startsWith("II*");
+    if (header.size() >= 8 && (little || header.startsWith(QByteArray("MM\0*", 4)))) {
+        auto read = [&](const QByteArray& data, int offset, int bytes) {
+            return little ? readLittleEndian(data, offset, bytes) : readBigEndian(data, offset, bytes);
+        };
+        if (!in.seek(read(header, 4, 4))) {
+            return false;
+        }
+        QByteArray countBytes = in.read(2);
+        if (countBytes.size() < 2) {
+            return false;
+        }
+        int count = static_cast<int>(read(countBytes, 0, 2));
+        QByteArray entries = in.read(count * 12);
+        for (int i = 0; i < count && (i + 1) * 12 <= entries.size(); i++) {
+            quint32 tag = read(entries, i * 12, 2);
+            quint32 type = read(entries, i * 12 + 2, 2);
+            quint32 value = type == 3 ? read(entries, i * 12 + 8, 2) : read(entries, i * 12 + 8, 4);
+            if (tag == 256) {
+                size.width = static_cast<int>(value);
+            }
+            else if (tag == 257) {
+                size.height = static_cast<int>(value);
+            }
+        }
+        return !size.empty();
+    }
+    return false;
+}
+
+/// Reads the size of a stack. The frames of a stack have the same size, so only the first file is read.
+/// \param files The image files
+/// \param skippedFrames The number of frames that are left out of the stack
+/// \return The size of the stack, an empty frame size if the first file could not be read
+StackShape ExecutionPlanner::readShape(const QStringList& files, int skippedFrames) {
+    StackShape shape;
+    shape.frames = std::max(0, static_cast<int>(files.size()) - skippedFrames);
+    if (files.isEmpty()) {
+        return shape;
+    }
+    if (!readImageSize(files.first(), shape.frameSize)) {
+        //Formats without a known header are decoded once
+        cv::Mat first = cv::imread(files.first().toStdString(), cv::IMREAD_COLOR);
+        shape.frameSize = first.size();
+    }
+    return shape;
+}
+
+/// Splits the cores between the pipeline stages in proportion to their cost per frame
+/// \param decodeCost The decode cost of a frame
+/// \param alignCost The align cost of a frame
+/// \param scoreCost The score cost of a frame
+/// \param cores The number of cores
+/// \return The thread counts
+PipelineConfig ExecutionPlanner::allocateThreads(double decodeCost, double alignCost, double scoreCost, int cores) {
+    double sum = std::max(1e-9, decodeCost + alignCost + scoreCost);
+    PipelineConfig config;
+    config.decodeThreads = std::clamp(static_cast<int>(std::lround(cores * decodeCost / sum)), 1, 4);
+    config.alignThreads = std::max(1, static_cast<int>(std::lround(cores * alignCost / sum)));
+    config.scoreThreads = std::max(1, static_cast<int>(std::lround(cores * scoreCost / sum)));
+    config.queueCapacity = 2;
+    config.opencvThreads = std::max(1, cores / (config.alignThreads + config.scoreThreads));
+    return config;
+}
+
+/// Predicts the run time of each stage
+/// \param shape The size of the stack
+/// \param params The stacking parameters
+/// \param mode How the layers are held
+/// \param config The thread counts of the pipeline
+/// \param depthScale The depth map resolution divisor
+/// \param cores The number of cores
+/// \return The predicted times, scaled by the calibration
+StageTimes ExecutionPlanner::predict(const StackShape& shape, const StackParameters& params, MemoryMode mode, const PipelineConfig& config, int depthScale, int cores) const {
+    const double megapixels = shape.frameSize.area() / 1e6;
+    const double depthMegapixels = megapixels / (depthScale * depthScale);
+    const bool singlePass = params.singlePass && !params.blendLayers;
+
+    //Tiled layers are only warped at the depth resolution for scoring
+    double decode = DecodeCost * megapixels;
+    double align = (params.translationFirst ? PhaseAlignCost : FeatureAlignCost) * megapixels;
+    align += mode == MemoryMode::Tiled ? (ReduceCost * megapixels + WarpCost * depthMegapixels) : WarpCost * megapixels;
+    double score = ScoreCost * depthMegapixels + (depthScale > 1 && mode != MemoryMode::Tiled ? ReduceCost * megapixels : 0.0);
+
+    //The slowest stage sets the pace, unless the cores are busy with all stages anyway
+    double perFrame = std::max({decode / config.decodeThreads, align / config.alignThreads, score / config.scoreThreads});
+    perFrame = std::max(perFrame, (decode + align + score) / cores);
+
+    StageTimes times;
+    times.pipeline = shape.frames * perFrame * calibration.pipeline;
+    if (singlePass) {
+        return times;
+    }
+
+    double smoothing = SmoothCost * depthMegapixels * params.smoothIterations * params.smoothKernelSize * params.smoothKernelSize / std::max(1, depthScale * depthScale);
+    double upsampling = depthScale > 1 ? UpsampleCost * megapixels : 0.0;
+    times.depthMap = (smoothing + upsampling) / speedup(cores) * calibration.depthMap;
+
+    double composite = 0.0;
+    if (mode == MemoryMode::InMemory) {
+        composite = BlendCost * megapixels;
+    }
+    else if (mode == MemoryMode::Tiled) {
+        composite = std::min(shape.frames, LayersPerTile) * (WarpCost + AccumulateCost) * megapixels / speedup(cores);
+    }
+    else {
+        //Frames are decoded one after another, the warp and the accumulation run on all cores
+        composite = shape.frames * (DecodeCost + (WarpCost + AccumulateCost) / speedup(cores)) * megapixels;
+    }
+    times.composite = composite * calibration.composite;
+    return times;
+}
+
+/// Predicts the peak memory use of a run
+/// \param shape The size of the stack
+/// \param mode How the layers are held
+/// \param config The thread counts of the pipeline
+/// \param depthScale The depth map resolution divisor
+/// \return The predicted peak in bytes
+size_t ExecutionPlanner::predictBytes(const StackShape& shape, MemoryMode mode, const PipelineConfig& config, int depthScale) {
+    const double pixels = static_cast<double>(shape.frameSize.area());
+    const double frameBytes = pixels * 3;
+    const double depthPixels = std::ceil(shape.frameSize.width / static_cast<double>(depthScale)) * std::ceil(shape.frameSize.height / static_cast<double>(depthScale));
+
+    double kept = mode == MemoryMode::OutOfCore ? frameBytes : shape.frames * frameBytes;
+
+    //Frames in flight: the queues, and per align thread the frame, its warp, its gray copy and the detector pyramid
+    double pipeline = 2.0 * config.queueCapacity * frameBytes + config.decodeThreads * frameBytes + config.alignThreads * 4.0 * frameBytes;
+    pipeline += config.scoreThreads * 64.0 * depthPixels; // Eight CV_64F buffers per score thread
+    pipeline += 12.0 * depthPixels;                       // Highest sharpness and the depth map
+
+    //Smoothing and upsampling, then the composite and its accumulator
+    double finish = 8.0 * depthPixels + (depthScale > 1 ? 12.0 * pixels : 0.0);
+    finish += frameBytes + (mode == MemoryMode::InMemory ? 0.0 : 6.0 * pixels);
+
+    return static_cast<size_t>(kept + std::max(pipeline, finish));
+}
+
+/// Picks the fastest plan that fits into the memory of the machine. The depth resolution chosen by
+/// the user is kept unless no memory mode fits at it, the thread counts are reduced before that.
+/// \param shape The size of the stack
+/// \param params The stacking parameters
+/// \param machine The machine resources
+/// \return The plan
+ExecutionPlan ExecutionPlanner::plan(const StackShape& shape, const StackParameters& params, const MachineResources& machine) const {
+    const size_t budget = machine.availableBytes / 10 * 8; // Leave room for the application and the system
+    const bool singlePass = params.singlePass && !params.blendLayers;
+    const int cores = std::max(1, machine.cores);
+
+    std::vector<MemoryMode> modes = {MemoryMode::InMemory, MemoryMode::Tiled, MemoryMode::OutOfCore};
+    if (singlePass) {
+        modes = {MemoryMode::OutOfCore}; // A single pass keeps no layers
+    }
+
+    ExecutionPlan best;
+    bool found = false;
+    for (int depthScale = std::max(1, params.depthScale); depthScale <= 8 && !found; depthScale *= 2) {
+        double megapixels = shape.frameSize.area() / 1e6;
+        double depthMegapixels = megapixels / (depthScale * depthScale);
+        double decode = DecodeCost * megapixels;
+        double align = ((params.translationFirst ? PhaseAlignCost : FeatureAlignCost) + WarpCost) * megapixels;
+        double score = ScoreCost * depthMegapixels;
+
+        //Fewer threads hold fewer frames in flight
+        std::vector<PipelineConfig> configs = {allocateThreads(decode, align, score, cores)};
+        while (configs.back().alignThreads > 1 || configs.back().scoreThreads > 1 || configs.back().queueCapacity > 1) {
+            PipelineConfig smaller = configs.back();
+            smaller.decodeThreads = 1;
+            smaller.alignThreads = std::max(1, smaller.alignThreads / 2);
+            smaller.scoreThreads = std::max(1, smaller.scoreThreads / 2);
+            smaller.queueCapacity = smaller.alignThreads == 1 && smaller.scoreThreads == 1 ? 1 : smaller.queueCapacity;
+            smaller.opencvThreads = std::max(1, cores / (smaller.alignThreads + smaller.scoreThreads));
+            configs.push_back(smaller);
+        }
+
+        for (MemoryMode mode : modes) {
+            for (const PipelineConfig& config : configs) {
+                size_t bytes = predictBytes(shape, mode, config, depthScale);
+                if (bytes > budget) {
+                    continue;
+                }
+                StageTimes times = predict(shape, params, mode, config, depthScale, cores);
+                if (!found || times.total() < best.predicted.total()) {
+                    best.memoryMode = mode;
+                    best.config = config;
+                    best.depthScale = depthScale;
+                    best.predictedBytes = bytes;
+                    best.predicted = times;
+                    found = true;
+                }
+                break; // Configs with fewer threads are only slower
+            }
+        }
+    }
+
+    //Nothing fits, take the plan that needs the least memory
+    if (!found) {
+        best.memoryMode = MemoryMode::OutOfCore;
+        best.config = allocateThreads(1.0, 1.0, 1.0, 3);
+        best.config.queueCapacity = 1;
+        best.depthScale = 8;
+        best.predictedBytes = predictBytes(shape, best.memoryMode, best.config, best.depthScale);
+        best.predicted = predict(shape, params, best.memoryMode, best.config, best.depthScale, cores);
+        best.fitsMemory = false;
+    }
+
+    //Larger tiles have less overhead, but every core needs a few tiles to balance the load
+    best.tileSize = 128;
+    for (int tileSize : {512, 256}) {
+        int tiles = ((shape.frameSize.width + tileSize - 1) / tileSize) * ((shape.frameSize.height + tileSize - 1) / tileSize);
+        if (tiles >= 4 * cores) {
+            best.tileSize = tileSize;
+            break;
+        }
+    }
+    return best;
+}
+
+/// Moves the calibration of each stage halfway towards the measured time, in log scale, so that
+/// a single unusual run does not throw off the model. Stages that were too short to time are left alone.
+/// \param plan The plan of the run
+/// \param actual The measured time of each stage
+void ExecutionPlanner::calibrate(const ExecutionPlan& plan, const StageTimes& actual) {
+    auto update = [](double& factor, double predicted, double measured) {
+        if (predicted > 0.0 && measured > 0.05) {
+            factor *= std::sqrt(std::clamp(measured / predicted, 0.25, 4.0));
+        }
+    };
+    update(calibration.pipeline, plan.predicted.pipeline, actual.pipeline);
+    update(calibration.depthMap, plan.predicted.depthMap, actual.depthMap);
+    update(calibration.composite, plan.predicted.composite, actual.composite);
+
+    QSettings settings("FocusPocus", "FocusPocus");
+    settings.setValue("Planner/pipeline", calibration.pipeline);
+    settings.setValue("Planner/depthMap", calibration.depthMap);
+    settings.setValue("Planner/composite", calibration.composite);
+}
@@ -0,0 +1,81 @@
+#ifndef EXECUTIONPLANNER_H
+#define EXECUTIONPLANNER_H
+
+#include <imageprocessing.h>
+#include <pipeline.h>
+#include <QString>
+#include <QStringList>
+#include <opencv2/core/core.hpp>
+
+/// Size of a stack, found from the file headers without decoding the images
+struct StackShape {
+    cv::Size frameSize;
+    int frames = 0;
+};
+
+/// Resources of the machine the stack is processed on
+struct MachineResources {
+    int cores = 1;
+    size_t availableBytes = 0; // Memory that can be used without swapping
+
+    static MachineResources detect();
+};
+
+/// How the layers are held between the alignment and the composite
+enum class MemoryMode {
+    InMemory,  // The warped layers are kept
+    Tiled,     // The original layers are kept and warped tile by tile while compositing
+    OutOfCore  // Only the transforms are kept, the layers are decoded again for the composite
+};
+
+/// Run time of the stages of a stack in seconds
+struct StageTimes {
+    double pipeline = 0.0;  // Decode, align and score, the stages run at the same time
+    double depthMap = 0.0;  // Smoothing and upsampling
+    double composite = 0.0;
+
+    double total() const { return pipeline + depthMap + composite; }
+};
+
+/// How a stack is processed, chosen before the run starts
+struct ExecutionPlan {
+    MemoryMode memoryMode = MemoryMode::InMemory;
+    PipelineConfig config;
+    int depthScale = 1;
+    int tileSize = 256;        // Tile edge of the tiled composite
+    size_t predictedBytes = 0;
+    bool fitsMemory = true;
+    StageTimes predicted;
+
+    StackParameters apply(const StackParameters& params) const;
+    QString describe() const;
+};
+
+/// Picks the memory mode, the thread allocation, the tile size and the depth resolution of a stack
+/// from its size and the machine resources with a cost model of the stages. The model is
+/// calibrated with the measured time of every planned run.
+class ExecutionPlanner {
+public:
+    ExecutionPlanner();
+
+    // Reads the image size of a PNG, JPEG, BMP or TIFF file from its header
+    static bool readImageSize(const QString& file, cv::Size& size);
+
+    // Reads the size of a stack from the header of its first file
+    static StackShape readShape(const QStringList& files, int skippedFrames = 0);
+
+    // Picks the fastest plan that fits into the memory of the machine
+    ExecutionPlan plan(const StackShape& shape, const StackParameters& params, const MachineResources& machine) const;
+
+    // Moves the calibration of each stage towards the measured time of a run
+    void calibrate(const ExecutionPlan& plan, const StageTimes& actual);
+
+private:
+    StageTimes predict(const StackShape& shape, const StackParameters& params, MemoryMode mode, const PipelineConfig& config, int depthScale, int cores) const;
+    static size_t predictBytes(const StackShape& shape, MemoryMode mode, const PipelineConfig& config, int depthScale);
+    static PipelineConfig allocateThreads(double decodeCost, double alignCost, double scoreCost, int cores);
+
+    StageTimes calibration; // Measured time relative to the model, per stage
+};
+
+#endif // EXECUTIONPLANNER_H
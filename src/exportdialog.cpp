@@ -47,3 +47,15 @@ void ExportDialog::valueChanged(int value)
 int ExportDialog::getImageQuality(){
     return ui->QualitySlider->value();
 }
+
+/// Returns whether a TIFF should be exported as well
+/// \return True if the TIFF option is checked
+bool ExportDialog::getExportTiff(){
+    return ui->ExportTiff->isChecked();
+}
+
+/// Returns whether a tiled BigTIFF should be exported as well
+/// \return True if the tiled BigTIFF option is checked
+bool ExportDialog::getExportBigTiff(){
+    return ui->ExportBigTiff->isChecked();
+}
@@ -15,6 +15,8 @@ public:
     explicit ExportDialog(QWidget *parent = nullptr);
     ~ExportDialog();
     int getImageQuality();
+    bool getExportTiff();
+    bool getExportBigTiff();
 
 
 private slots:
@@ -0,0 +1,101 @@
+/****************************************************************************
+** File Name:   focuspocus_core.cpp
+**
+** Description:
+**     This file contains the plain C++ interface of the stacking core. It
+**     wraps caller owned buffers without copying them and runs them through
+**     the same pipeline as the application.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "focuspocus_core.h"
+#include "imageprocessing.h"
+#include "framesource.h"
+#include "kernels.h"
+
+namespace focuspocus {
+
+struct Stacker::Impl {
+    ImageProcessing processor;
+    ProgressCallback progressCallback;
+};
+
+/// Wraps a caller owned buffer in a matrix header, no pixels are copied
+/// \param view The caller owned image
+/// \return The matrix header
+static cv::Mat wrap(const ImageView& view) {
+    size_t stride = view.stride != 0 ? view.stride : static_cast<size_t>(view.width) * 3;
+    return cv::Mat(view.height, view.width, CV_8UC3, view.data, stride);
+}
+
+Stacker::Stacker()
+    : impl(new Impl)
+{
+    //Progress is emitted from the pipeline threads, a direct connection calls the callback right there
+    QObject::connect(&impl->processor, &ImageProcessing::progress, [this](QString label, int value, int max) {
+        if (impl->progressCallback) {
+            impl->progressCallback(label.toStdString(), value, max);
+        }
+    });
+}
+
+Stacker::~Stacker() = default;
+
+/// Sets the callback that receives progress reports
+/// \param callback The callback, it may be called from worker threads
+void Stacker::setProgressCallback(ProgressCallback callback) {
+    impl->progressCallback = std::move(callback);
+}
+
+/// Stacks caller owned frames into a caller owned output image
+/// \param frames The frames, frame 0 is the base image
+/// \param params The stacking parameters
+/// \param output Receives the composite, must have the size of the frames
+/// \return False if the frames could not be stacked
+bool Stacker::stack(const std::vector<ImageView>& frames, const Parameters& params, ImageView output) {
+    if (frames.empty() || output.data == nullptr) {
+        return false;
+    }
+
+    std::vector<cv::Mat> images;
+    images.reserve(frames.size());
+    for (const ImageView& frame : frames) {
+        images.push_back(wrap(frame));
+    }
+
+    StackParameters stackParams;
+    stackParams.laplaceKernelSize = params.laplaceKernelSize;
+    stackParams.smoothKernelSize = params.smoothKernelSize;
+    stackParams.smoothStrength = params.smoothStrength;
+    stackParams.smoothIterations = params.smoothIterations;
+    stackParams.blendLayers = params.blendLayers;
+    stackParams.depthScale = params.depthScale;
+    stackParams.pruneLayers = params.pruneLayers;
+    stackParams.translationFirst = params.translationFirst;
+
+    MatSource source(images);
+    cv::Mat composite = impl->processor.stack_frames(source, stackParams);
+
+    cv::Mat target = wrap(output);
+    if (composite.empty() || composite.size() != target.size() || composite.type() != target.type()) {
+        return false;
+    }
+    composite.copyTo(target);
+    return true;
+}
+
+/// Returns the instruction set the processing kernels were picked for
+/// \return The name of the instruction set
+std::string Stacker::kernelName() {
+    return kernels().name;
+}
+
+} // namespace focuspocus
@@ -0,0 +1,62 @@
+#ifndef FOCUSPOCUS_CORE_H
+#define FOCUSPOCUS_CORE_H
+
+// Plain C++ interface of the FocusPocus stacking core. It depends on neither Qt widgets nor
+// OpenCV headers, so it can be embedded in other programs such as capture services.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace focuspocus {
+
+/// An 8 bit BGR image owned by the caller. The core reads and writes the pixels in place and
+/// never keeps a reference after a call returns.
+struct ImageView {
+    uint8_t* data = nullptr;
+    int width = 0;
+    int height = 0;
+    size_t stride = 0; // Bytes per row, 0 for tightly packed rows
+};
+
+/// Parameters of a stacking run, see StackParameters for their meaning
+struct Parameters {
+    int laplaceKernelSize = 3;
+    int smoothKernelSize = 17;
+    int smoothStrength = 100;
+    int smoothIterations = 5;
+    bool blendLayers = true;
+    int depthScale = 1;
+    bool pruneLayers = false;
+    bool translationFirst = false;
+};
+
+// Called with a stage description and its progress, may be called from worker threads
+using ProgressCallback = std::function<void(const std::string& stage, int value, int max)>;
+
+/// Focus stacks caller owned images
+class Stacker {
+public:
+    Stacker();
+    ~Stacker();
+
+    // Sets the callback that receives progress reports
+    void setProgressCallback(ProgressCallback callback);
+
+    // Stacks the frames into output, frame 0 is the base image. Output must have the size of the frames.
+    bool stack(const std::vector<ImageView>& frames, const Parameters& params, ImageView output);
+
+    // Returns the instruction set the processing kernels were picked for
+    static std::string kernelName();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+} // namespace focuspocus
+
+#endif // FOCUSPOCUS_CORE_H
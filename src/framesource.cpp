@@ -0,0 +1,203 @@
+/****************************************************************************
+** File Name:   framesource.cpp
+**
+** Description:
+**     This file contains the frame sources that feed the processing
+**     pipeline, either from image files on disk, from a video or from
+**     images that are already in memory.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "framesource.h"
+#include <opencv2/imgcodecs.hpp>
+#include <QtGlobal>
+#include <QDir>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <algorithm>
+#include <iostream>
+
+/// Returns a small grayscale preview of a frame
+/// \param index The index of the frame
+/// \return The preview, empty if the source cannot provide one cheaply
+cv::Mat FrameSource::thumbnail(int index) {
+    Q_UNUSED(index);
+    return cv::Mat();
+}
+
+/// Leaves a frame out of the stack
+/// \param index The index of the frame
+void FrameSource::skip(int index) {
+    if (index >= static_cast<int>(skipped.size())) {
+        skipped.resize(index + 1, false);
+    }
+    skipped[index] = true;
+}
+
+/// Checks if a frame has been left out
+/// \param index The index of the frame
+/// \return True if the frame should not be handed out
+bool FrameSource::isSkipped(int index) const {
+    return index < static_cast<int>(skipped.size()) && skipped[index];
+}
+
+ImageFileSource::ImageFileSource(const QStringList &files)
+    : files(files)
+{}
+
+/// Returns the number of files
+/// \return The number of files
+int ImageFileSource::count() const {
+    return files.size();
+}
+
+/// Decodes the next file
+/// \param index Receives the index of the frame
+/// \param frame Receives the decoded frame
+/// \return False when all files have been handed out
+bool ImageFileSource::next(int &index, cv::Mat &frame) {
+    do {
+        index = nextIndex.fetch_add(1);
+        if (index >= files.size()) {
+            return false;
+        }
+    } while (isSkipped(index));
+
+    frame = cv::imread(files[index].toStdString());
+    if (frame.empty()) {
+        std::cerr << "Could not decode " << files[index].toStdString() << std::endl;
+    }
+    return true;
+}
+
+/// Decodes a file at 1/8 resolution, JPEG files are scaled while decoding which is much
+/// faster than decoding the full image
+/// \param index The index of the frame
+/// \return The grayscale preview
+cv::Mat ImageFileSource::thumbnail(int index) {
+    if (index < 0 || index >= files.size()) {
+        return cv::Mat();
+    }
+    return cv::imread(files[index].toStdString(), cv::IMREAD_REDUCED_GRAYSCALE_8);
+}
+
+/// Finds the files of a numbered image sequence, e.g. frame_0001.jpg, frame_0002.jpg, ...
+/// \param file Any file of the sequence
+/// \return The files of the sequence ordered by their number, only the file itself if it is not numbered
+QStringList ImageFileSource::sequenceFiles(const QString &file) {
+    static const QRegularExpression numbered("^(.*?)(\\d+)(\\.[^.]+)$");
+
+    QFileInfo info(file);
+    QRegularExpressionMatch match = numbered.match(info.fileName());
+    if (!match.hasMatch()) {
+        return QStringList() << file;
+    }
+    QString prefix = match.captured(1);
+    QString suffix = match.captured(3);
+
+    std::vector<std::pair<qlonglong, QString>> numberedFiles;
+    const QStringList entries = info.dir().entryList(QStringList() << prefix + "*" + suffix, QDir::Files);
+    for (const QString &entry : entries) {
+        QRegularExpressionMatch entryMatch = numbered.match(entry);
+        if (entryMatch.hasMatch() && entryMatch.captured(1) == prefix && entryMatch.captured(3) == suffix) {
+            numberedFiles.emplace_back(entryMatch.captured(2).toLongLong(), info.dir().filePath(entry));
+        }
+    }
+    std::sort(numberedFiles.begin(), numberedFiles.end());
+
+    QStringList sequence;
+    for (const auto &numberedFile : numberedFiles) {
+        sequence << numberedFile.second;
+    }
+    return sequence;
+}
+
+/// Opens a video
+/// \param path The video file
+/// \param decimation Only every decimation:th frame of the video is handed out
+VideoSource::VideoSource(const QString &path, int decimation)
+    : capture(path.toStdString()), decimation(std::max(1, decimation)), frameCount(-1)
+{
+    if (!capture.isOpened()) {
+        std::cerr << "Could not open video " << path.toStdString() << std::endl;
+        return;
+    }
+
+    //Containers do not always store the frame count, the count is then unknown
+    int frames = static_cast<int>(capture.get(cv::CAP_PROP_FRAME_COUNT));
+    if (frames > 0) {
+        frameCount = (frames + this->decimation - 1) / this->decimation;
+    }
+}
+
+/// Returns the number of frames after decimation
+/// \return The number of frames, or -1 if the video does not store it
+int VideoSource::count() const {
+    return frameCount;
+}
+
+/// Decodes the next kept frame, the frames in between are grabbed without being decoded
+/// \param index Receives the index of the frame
+/// \param frame Receives the decoded frame
+/// \return False when the video has ended
+bool VideoSource::next(int &index, cv::Mat &frame) {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (capture.isOpened()) {
+        index = nextIndex++;
+        if (!capture.read(frame) || frame.empty()) {
+            capture.release();
+            return false;
+        }
+        for (int i = 1; i < decimation; i++) {
+            if (!capture.grab()) {
+                break;
+            }
+        }
+        if (!isSkipped(index)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Checks the file extension of a file
+/// \param path The file path
+/// \return True if the file is a video
+bool VideoSource::isVideo(const QString &path) {
+    static const QStringList videoSuffixes = {"mp4", "mov", "avi", "mkv", "m4v", "mts", "webm"};
+    return videoSuffixes.contains(QFileInfo(path).suffix().toLower());
+}
+
+MatSource::MatSource(const std::vector<cv::Mat> &images)
+    : images(images)
+{}
+
+/// Returns the number of images
+/// \return The number of images
+int MatSource::count() const {
+    return static_cast<int>(images.size());
+}
+
+/// Hands out the next image
+/// \param index Receives the index of the frame
+/// \param frame Receives the frame
+/// \return False when all images have been handed out
+bool MatSource::next(int &index, cv::Mat &frame) {
+    do {
+        index = nextIndex.fetch_add(1);
+        if (index >= static_cast<int>(images.size())) {
+            return false;
+        }
+    } while (isSkipped(index));
+
+    frame = images[index];
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include <QStringList>
+#include <opencv2/core/core.hpp>
+#include <opencv2/videoio.hpp>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/// Supplies the frames of a stack to the processing pipeline.
+/// next() may be called from several decode threads at the same time.
+class FrameSource {
+public:
+    virtual ~FrameSource() = default;
+
+    // Number of frames, or -1 if it is not known in advance
+    virtual int count() const = 0;
+
+    // Reads the next frame, returns false when the source is exhausted
+    virtual bool next(int &index, cv::Mat &frame) = 0;
+
+    // Returns a small grayscale preview of a frame, empty if the source cannot provide one cheaply
+    virtual cv::Mat thumbnail(int index);
+
+    // Leaves a frame out of the stack, must be called before the pipeline starts
+    void skip(int index);
+
+protected:
+    bool isSkipped(int index) const;
+
+private:
+    std::vector<bool> skipped;
+};
+
+/// Decodes a list of image files, several files are decoded in parallel
+class ImageFileSource : public FrameSource {
+public:
+    explicit ImageFileSource(const QStringList &files);
+
+    int count() const override;
+    bool next(int &index, cv::Mat &frame) override;
+    cv::Mat thumbnail(int index) override;
+
+    // Returns all files of the numbered image sequence a file belongs to, in numeric order
+    static QStringList sequenceFiles(const QString &file);
+
+private:
+    QStringList files;
+    std::atomic<int> nextIndex{0};
+};
+
+/// Hands out images that are already in memory
+class MatSource : public FrameSource {
+public:
+    explicit MatSource(const std::vector<cv::Mat> &images);
+
+    int count() const override;
+    bool next(int &index, cv::Mat &frame) override;
+
+private:
+    std::vector<cv::Mat> images;
+    std::atomic<int> nextIndex{0};
+};
+
+/// Decodes the frames of a video one after another. Video frames can only be decoded in order,
+/// so the decode threads take turns instead of decoding in parallel.
+class VideoSource : public FrameSource {
+public:
+    VideoSource(const QString &path, int decimation = 1);
+
+    int count() const override;
+    bool next(int &index, cv::Mat &frame) override;
+
+    // Returns true if a file should be opened as a video rather than an image
+    static bool isVideo(const QString &path);
+
+private:
+    cv::VideoCapture capture;
+    int decimation;
+    int frameCount;
+    int nextIndex = 0;
+    std::mutex mutex;
+};
+
+#endif // FRAMESOURCE_H
@@ -0,0 +1,251 @@
+/****************************************************************************
+** File Name:   imageexporter.cpp
+**
+** Description:
+**     This file contains the implementation of the ImageExporter class,
+**     which writes stacking results to disk in the background. Results can
+**     be written as TIFF and as tiled, deflate compressed BigTIFF for
+**     composites that are too large for a regular TIFF file.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "imageexporter.h"
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <QFile>
+#include <QFileInfo>
+#include <QByteArray>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+ImageExporter::ImageExporter(QObject *parent)
+    : QObject{parent}
+{}
+
+/// Checks if a file has to be written with the tiled BigTIFF writer
+/// \param image The image to write
+/// \param file The file path
+/// \return True for .btf files and for TIFF files too large for a regular TIFF file
+bool ImageExporter::needs_bigtiff(const cv::Mat& image, const QString& file) {
+    QString suffix = QFileInfo(file).suffix().toLower();
+    if (suffix == "btf" || suffix == "tf8") {
+        return true;
+    }
+    //Regular TIFF offsets are 32 bit, leave room for the directory and compression overhead
+    const double regularTiffLimit = 2.0 * 1024 * 1024 * 1024;
+    return (suffix == "tif" || suffix == "tiff") && image.total() * image.elemSize() >= regularTiffLimit;
+}
+
+/// Returns the number of progress steps of writing a file
+/// \param image The image to write
+/// \param file The file path
+/// \return The number of tile rows for tiled files, otherwise 1
+int ImageExporter::export_steps(const cv::Mat& image, const QString& file) {
+    return needs_bigtiff(image, file) ? (image.rows + TileSize - 1) / TileSize : 1;
+}
+
+/// Writes an image in the format given by the file extension
+/// \param image The image to write
+/// \param file The file path
+/// \param quality The image quality 0-100, or -1 for the default of the format
+/// \param done The progress steps finished by all writers
+/// \param total The progress steps of all writers
+/// \return True if the file was written
+bool ImageExporter::write_image(const cv::Mat& image, const QString& file, int quality, std::atomic<int>& done, int total) {
+    if (needs_bigtiff(image, file)) {
+        return write_tiled_bigtiff(image, file, done, total);
+    }
+
+    std::vector<int> flags;
+    QString suffix = QFileInfo(file).suffix().toLower();
+    if (quality >= 0 && (suffix == "jpg" || suffix == "jpeg")) {
+        flags = {cv::IMWRITE_JPEG_QUALITY, quality};
+    }
+    else if (quality >= 0 && suffix == "png") {
+        //Same meaning as for QImage::save, 0 is the smallest file and 100 the fastest to write
+        flags = {cv::IMWRITE_PNG_COMPRESSION, (100 - quality) * 9 / 100};
+    }
+
+    bool ok = false;
+    try {
+        ok = cv::imwrite(file.toStdString(), image, flags);
+    }
+    catch (const cv::Exception& e) {
+        std::cerr << "Could not write " << file.toStdString() << ": " << e.what() << std::endl;
+    }
+    emit progress("Exporting image.", ++done, total);
+    return ok;
+}
+
+/// Writes an image as a tiled BigTIFF file. The image is written one row of tiles at a time and the
+/// tiles of a row are deflate compressed in parallel, so the whole encoded file is never in memory.
+/// \param image The image to write, 8 or 16 bit with 1 or 3 channels
+/// \param file The file path
+/// \param done The progress steps finished by all writers
+/// \param total The progress steps of all writers
+/// \return True if the file was written
+bool ImageExporter::write_tiled_bigtiff(const cv::Mat& image, const QString& file, std::atomic<int>& done, int total) {
+    if (image.channels() != 1 && image.channels() != 3) {
+        std::cerr << "BigTIFF export supports 1 and 3 channel images only" << std::endl;
+        return false;
+    }
+
+    QFile out(file);
+    if (!out.open(QIODevice::WriteOnly)) {
+        std::cerr << "Could not open " << file.toStdString() << " for writing" << std::endl;
+        return false;
+    }
+
+    //Numbers are written in native byte order and the header tells the reader which one that is
+    auto append = [](QByteArray& buffer, auto value) {
+        buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+
+    QByteArray header;
+    header.append(Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? "II" : "MM", 2);
+    append(header, quint16(43));  // BigTIFF
+    append(header, quint16(8));   // Size of offsets
+    append(header, quint16(0));
+    append(header, quint64(0));   // Offset of the first directory, written last
+    out.write(header);
+
+    const int tilesAcross = (image.cols + TileSize - 1) / TileSize;
+    const int tilesDown = (image.rows + TileSize - 1) / TileSize;
+    std::vector<quint64> tileOffsets(static_cast<size_t>(tilesAcross) * tilesDown);
+    std::vector<quint64> tileByteCounts(tileOffsets.size());
+
+    for (int ty = 0; ty < tilesDown; ty++) {
+        std::vector<QByteArray> tiles(tilesAcross);
+        cv::parallel_for_(cv::Range(0, tilesAcross), [&](const cv::Range& range) {
+            for (int tx = range.start; tx < range.end; tx++) {
+                //Edge tiles are padded to the full tile size
+                cv::Rect rect(tx * TileSize, ty * TileSize, std::min(TileSize, image.cols - tx * TileSize), std::min(TileSize, image.rows - ty * TileSize));
+                cv::Mat tile = cv::Mat::zeros(TileSize, TileSize, image.type());
+                image(rect).copyTo(tile(cv::Rect(0, 0, rect.width, rect.height)));
+                if (tile.channels() == 3) {
+                    cv::cvtColor(tile, tile, cv::COLOR_BGR2RGB);
+                }
+
+                //qCompress prefixes the zlib stream with its length, TIFF only wants the stream
+                QByteArray compressed = qCompress(tile.data, static_cast<int>(tile.total() * tile.elemSize()));
+                tiles[tx] = compressed.mid(4);
+            }
+        });
+
+        for (int tx = 0; tx < tilesAcross; tx++) {
+            size_t index = static_cast<size_t>(ty) * tilesAcross + tx;
+            tileOffsets[index] = static_cast<quint64>(out.pos());
+            tileByteCounts[index] = static_cast<quint64>(tiles[tx].size());
+            if (out.write(tiles[tx]) != tiles[tx].size()) {
+                std::cerr << "Could not write " << file.toStdString() << std::endl;
+                return false;
+            }
+        }
+        emit progress("Exporting image.", ++done, total);
+    }
+
+    //Arrays of more than one value are stored outside the directory
+    auto writeArray = [&](const std::vector<quint64>& values) -> quint64 {
+        if (values.size() == 1) {
+            return values[0];
+        }
+        quint64 offset = static_cast<quint64>(out.pos());
+        out.write(reinterpret_cast<const char*>(values.data()), static_cast<qint64>(values.size() * sizeof(quint64)));
+        return offset;
+    };
+    quint64 offsetsValue = writeArray(tileOffsets);
+    quint64 byteCountsValue = writeArray(tileByteCounts);
+
+    //The directory has to start on a word boundary
+    if (out.pos() % 2 != 0) {
+        out.write("\0", 1);
+    }
+    quint64 directoryOffset = static_cast<quint64>(out.pos());
+
+    const quint16 Short = 3, Long = 4, Long8 = 16;
+    const quint16 bitsPerSample = static_cast<quint16>(image.elemSize1() * 8);
+    const int channels = image.channels();
+
+    QByteArray directory;
+    append(directory, quint64(11));
+    auto entry = [&](quint16 tag, quint16 type, quint64 count, const void* value, size_t valueSize) {
+        append(directory, tag);
+        append(directory, type);
+        append(directory, count);
+        char inlineValue[8] = {0};
+        std::memcpy(inlineValue, value, valueSize);
+        directory.append(inlineValue, 8);
+    };
+    auto shortEntry = [&](quint16 tag, quint16 value) { entry(tag, Short, 1, &value, sizeof(value)); };
+    auto longEntry = [&](quint16 tag, quint32 value) { entry(tag, Long, 1, &value, sizeof(value)); };
+
+    quint16 bits[3] = {bitsPerSample, bitsPerSample, bitsPerSample};
+    longEntry(256, static_cast<quint32>(image.cols));        // ImageWidth
+    longEntry(257, static_cast<quint32>(image.rows));        // ImageLength
+    entry(258, Short, channels, bits, channels * sizeof(quint16)); // BitsPerSample
+    shortEntry(259, 8);                                      // Compression, deflate
+    shortEntry(262, channels == 3 ? 2 : 1);                  // PhotometricInterpretation, RGB or gray
+    shortEntry(277, static_cast<quint16>(channels));         // SamplesPerPixel
+    shortEntry(284, 1);                                      // PlanarConfiguration, interleaved
+    longEntry(322, TileSize);                                // TileWidth
+    longEntry(323, TileSize);                                // TileLength
+    entry(324, Long8, tileOffsets.size(), &offsetsValue, sizeof(offsetsValue));       // TileOffsets
+    entry(325, Long8, tileByteCounts.size(), &byteCountsValue, sizeof(byteCountsValue)); // TileByteCounts
+    append(directory, quint64(0)); // No further directories
+    out.write(directory);
+
+    out.seek(8);
+    out.write(reinterpret_cast<const char*>(&directoryOffset), sizeof(directoryOffset));
+
+    out.close();
+    return out.error() == QFileDevice::NoError;
+}
+
+/// Writes an image to one or more files with 8 bits per sample. The image is converted once and
+/// every file is written by its own thread.
+/// \param image The image to write
+/// \param files The files to write, the format is given by the file extension
+/// \param quality The image quality 0-100, or -1 for the default of the format
+void ImageExporter::export_image(const cv::Mat& image, const QStringList& files, int quality) {
+    cv::Mat image8 = image;
+    if (image.depth() != CV_8U) {
+        image.convertTo(image8, CV_8U, image.depth() == CV_16U ? 1.0 / 257.0 : 1.0);
+    }
+
+    int total = 0;
+    for (const QString& file : files) {
+        total += export_steps(image8, file);
+    }
+
+    std::atomic<int> done{0};
+    emit progress("Exporting image.", 0, total);
+
+    std::vector<char> written(files.size(), 0);
+    std::vector<std::thread> writers;
+    for (int i = 0; i < files.size(); i++) {
+        writers.emplace_back([&, i]() {
+            written[i] = write_image(image8, files[i], quality, done, total);
+        });
+    }
+    for (std::thread& writer : writers) {
+        writer.join();
+    }
+
+    QStringList failedFiles;
+    for (int i = 0; i < files.size(); i++) {
+        if (!written[i]) {
+            failedFiles << files[i];
+        }
+    }
+    emit exportComplete(failedFiles);
+}
@@ -0,0 +1,33 @@
+#ifndef IMAGEEXPORTER_H
+#define IMAGEEXPORTER_H
+
+#include <QObject>
+#include <QStringList>
+#include <opencv2/core/core.hpp>
+#include <atomic>
+
+/// Writes stacking results to disk on a background thread. All requested formats are
+/// written from the same cv::Mat, each by its own thread.
+class ImageExporter : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ImageExporter(QObject *parent = nullptr);
+
+    static const int TileSize = 256;
+
+private:
+    bool write_image(const cv::Mat& image, const QString& file, int quality, std::atomic<int>& done, int total);
+    bool write_tiled_bigtiff(const cv::Mat& image, const QString& file, std::atomic<int>& done, int total);
+    static int export_steps(const cv::Mat& image, const QString& file);
+    static bool needs_bigtiff(const cv::Mat& image, const QString& file);
+
+public slots:
+    void export_image(const cv::Mat& image, const QStringList& files, int quality);
+
+signals:
+    void progress(QString label, int value, int max);
+    void exportComplete(QStringList failedFiles);
+};
+
+#endif // IMAGEEXPORTER_H
@@ -1,4 +1,7 @@
 #include "imageprocessing.h"
+#include "executionplanner.h"
+#include "kernels.h"
+#include <cstring>
 
 /****************************************************************************
 ** File Name:   imageprocessing.cpp
@@ -20,190 +23,954 @@
 
 ImageProcessing::ImageProcessing(QObject *parent)
     : QObject{parent}
-{}
+    , pipelineConfig(PipelineConfig::defaults())
+{
+    std::cout << "Using " << kernels().name << " kernels" << std::endl;
+}
+
+/// Stacks the frames of a source and returns the composite directly, without any signals
+/// other than progress. Used by callers that do not run an event loop.
+/// \param source The frames of the stack, frame 0 is the base image
+/// \param params The stacking parameters
+/// \param transforms If given and holding one transform per frame, the frames are warped with these
+/// instead of being matched. If given and empty, receives the transforms of the run.
+/// \return The composite image, empty if the frames could not be stacked
+cv::Mat ImageProcessing::stack_frames(FrameSource& source, const StackParameters& params, std::vector<cv::Mat>* transforms) {
+    if (transforms == nullptr) {
+        return stack_slab(source, params, pipelineConfig);
+    }
+
+    bool reuse = !transforms->empty() && static_cast<int>(transforms->size()) == source.count();
+    StackLayers layers = run_pipeline(source, reuse ? transforms : nullptr, params, true, pipelineConfig);
+    if (layers.layerCount == 0) {
+        return cv::Mat();
+    }
+    if (!reuse) {
+        *transforms = layers.transforms;
+    }
+
+    cv::Mat depthMap = create_depth_map(layers.rawDepthMap, layers.baseImage, layers.layerCount, params);
+    return composite_layers(layers, depthMap, params.blendLayers);
+}
+
+/// Sets the number of threads used by each pipeline stage
+/// \param config The pipeline configuration
+void ImageProcessing::set_pipeline_config(const PipelineConfig& config) {
+    pipelineConfig = config;
+}
 
 /// Computes the local variance of an image
 /// \param laplacian The input image
 /// \param varianceMap The output variance map
 /// \param windowSize The size of the window for computing the local variance
-void ImageProcessing::compute_local_variance(const cv::Mat& laplacian, cv::Mat& varianceMap, int windowSize) {
+/// \param workspace The buffers of the calling thread
+void ImageProcessing::compute_local_variance(const cv::Mat& laplacian, cv::Mat& varianceMap, int windowSize, ScoreWorkspace& workspace) {
     // Compute the squared Laplacian
-    cv::Mat laplacianSquared;
-    cv::pow(laplacian, 2, laplacianSquared);
+    cv::multiply(laplacian, laplacian, workspace.laplacianSquared);
 
     // Compute the mean of the Laplacian
-    cv::Mat mean, meanSquare;
-    cv::boxFilter(laplacian, mean, CV_64F, cv::Size(windowSize, windowSize));
+    cv::boxFilter(laplacian, workspace.mean, CV_64F, cv::Size(windowSize, windowSize));
 
     // Compute the mean of the squared Laplacian
-    cv::boxFilter(laplacianSquared, meanSquare, CV_64F, cv::Size(windowSize, windowSize));
+    cv::boxFilter(workspace.laplacianSquared, workspace.meanSquare, CV_64F, cv::Size(windowSize, windowSize));
+
+    // Compute the variance: variance = meanSquare - mean^2, in place so that no temporaries are allocated
+    cv::multiply(workspace.mean, workspace.mean, workspace.mean);
+    cv::subtract(workspace.meanSquare, workspace.mean, varianceMap);
+}
+
+/// Prepares the base image that every other layer is aligned to. When translation is tried first,
+/// the features of the base image are only detected once a layer needs them.
+/// \param base The base image
+/// \param alignmentBase Receives the base image data
+/// \param translationFirst Whether layers are first aligned by phase correlation
+/// \return False if the base image can not be aligned to
+bool ImageProcessing::prepare_alignment_base(const cv::Mat& base, AlignmentBase& alignmentBase, bool translationFirst) {
+    alignmentBase.size = base.size();
+    alignmentBase.image = base;
+
+    if (!translationFirst) {
+        return detect_base_features(alignmentBase);
+    }
+
+    //Phase correlation is done at about 1024 pixels across, sub-pixel accuracy makes up for the scale
+    const double phaseSize = 1024.0;
+    alignmentBase.phaseScale = std::max(1.0, std::max(base.cols, base.rows) / phaseSize);
+    cv::Size size(cvRound(base.cols / alignmentBase.phaseScale), cvRound(base.rows / alignmentBase.phaseScale));
+
+    cv::Mat gray, small;
+    cv::cvtColor(base, gray, cv::COLOR_BGR2GRAY);
+    cv::resize(gray, small, size, 0, 0, cv::INTER_AREA);
+    small.convertTo(alignmentBase.phaseGray, CV_32F);
+    cv::createHanningWindow(alignmentBase.phaseWindow, size, CV_32F);
+    cv::createHanningWindow(alignmentBase.quadrantWindow, cv::Size(size.width / 2, size.height / 2), CV_32F);
+    return true;
+}
+
+/// Detects the features of the base image, only the first call does any work
+/// \param alignmentBase The base image data
+/// \return False if no features were found
+bool ImageProcessing::detect_base_features(AlignmentBase& alignmentBase) {
+    std::call_once(*alignmentBase.featuresDetected, [&]() {
+        cv::Ptr<SIFT> detector = cv::SIFT::create( );
+
+        cv::Mat baseGray;
+        cv::cvtColor(alignmentBase.image, baseGray, cv::COLOR_BGR2GRAY);
+        cv::equalizeHist(baseGray, baseGray);
+        detector->detectAndCompute(baseGray, cv::noArray(), alignmentBase.keypoints, alignmentBase.descriptors);
+    });
+    return !alignmentBase.descriptors.empty();
+}
+
+/// Estimates a translation only transform by phase correlation of downscaled gray images. The shift
+/// is estimated for each quadrant as well, rotation or magnification between the layers makes the
+/// quadrants disagree with the whole image.
+/// \param image The image to align
+/// \param alignmentBase The base image data
+/// \param workspace The buffers of the calling thread
+/// \param prior A transform the image is warped with first, only the remaining shift is then estimated
+/// \return The 2x3 transform, empty if a translation does not explain the difference to the base image
+cv::Mat ImageProcessing::estimate_translation(const cv::Mat& image, const AlignmentBase& alignmentBase, AlignWorkspace& workspace, const cv::Mat& prior) {
+    const double minResponse = 0.05; // Peak height of the phase correlation, lower means no clear shift
+    const double maxResidual = 1.0;  // Largest disagreement of a quadrant in full resolution pixels
+
+    cv::cvtColor(image, workspace.gray, cv::COLOR_BGR2GRAY);
+    cv::resize(workspace.gray, workspace.phaseSmall, alignmentBase.phaseGray.size(), 0, 0, cv::INTER_AREA);
+    workspace.phaseSmall.convertTo(workspace.phaseGray, CV_32F);
+
+    //The prior is applied at the phase resolution, where its translation is smaller by the scale
+    cv::Mat H = cv::Mat::eye(2, 3, CV_64F);
+    if (!prior.empty()) {
+        prior.convertTo(H, CV_64F);
+        cv::Mat scaledPrior = H.clone();
+        scaledPrior.col(2) /= alignmentBase.phaseScale;
+        cv::warpAffine(workspace.phaseGray, workspace.phaseWarped, scaledPrior, workspace.phaseGray.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+        cv::swap(workspace.phaseGray, workspace.phaseWarped);
+    }
+
+    double response = 0.0;
+    cv::Point2d shift = cv::phaseCorrelate(alignmentBase.phaseGray, workspace.phaseGray, alignmentBase.phaseWindow, &response);
+    if (response < minResponse) {
+        return cv::Mat();
+    }
+
+    double residual = 0.0;
+    cv::Size quadrantSize = alignmentBase.quadrantWindow.size();
+    for (int q = 0; q < 4; q++) {
+        cv::Rect rect((q % 2) * quadrantSize.width, (q / 2) * quadrantSize.height, quadrantSize.width, quadrantSize.height);
+        workspace.phaseGray(rect).copyTo(workspace.quadrant);
+        cv::Point2d quadrantShift = cv::phaseCorrelate(alignmentBase.phaseGray(rect).clone(), workspace.quadrant, alignmentBase.quadrantWindow);
+        residual = std::max(residual, cv::norm(quadrantShift - shift) * alignmentBase.phaseScale);
+    }
+    workspace.track();
+    if (residual > maxResidual) {
+        return cv::Mat();
+    }
+
+    //The layer content is shifted by the correlation shift, move it back onto the base image
+    H.at<double>(0, 2) -= shift.x * alignmentBase.phaseScale;
+    H.at<double>(1, 2) -= shift.y * alignmentBase.phaseScale;
+    return H;
+}
+
+/// Estimates the transform that aligns an image to the base image, by translation if requested and
+/// it fits, otherwise by feature matching
+/// \param image The image to align
+/// \param alignmentBase The base image data
+/// \param detector The feature detector, one per thread
+/// \param workspace The buffers of the calling thread
+/// \param translationFirst Whether to try a translation first
+/// \return The 2x3 transform, empty if the image could not be aligned
+cv::Mat ImageProcessing::estimate_alignment(const cv::Mat& image, AlignmentBase& alignmentBase, const cv::Ptr<SIFT>& detector, AlignWorkspace& workspace, bool translationFirst) {
+    if (translationFirst) {
+        cv::Mat H = estimate_translation(image, alignmentBase, workspace);
+        if (!H.empty()) {
+            return H;
+        }
+        std::cout << "Translation does not fit, matching features" << std::endl;
+    }
+    return estimate_transform(image, alignmentBase, detector, workspace);
+}
+
+/// Estimates the transform that aligns an image to the base image using SIFT feature matching
+/// \param image The image to align
+/// \param alignmentBase The features of the base image
+/// \param detector The feature detector, one per thread
+/// \param workspace The buffers of the calling thread
+/// \return The 2x3 transform, empty if the image could not be aligned
+cv::Mat ImageProcessing::estimate_transform(const cv::Mat& image, AlignmentBase& alignmentBase, const cv::Ptr<SIFT>& detector, AlignWorkspace& workspace) {
+    if (!detect_base_features(alignmentBase)) {
+        return cv::Mat();
+    }
+
+    std::vector<cv::KeyPoint>& keypoints = workspace.keypoints;
+    cv::Mat& descriptors = workspace.descriptors;
+    cv::Mat& gray = workspace.gray;
+    cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    cv::equalizeHist(gray, gray);
 
-    // Compute the variance: variance = meanSquare - mean^2
-    varianceMap = meanSquare - mean.mul(mean); // mul is element-wise multiplication
+    keypoints.clear();
+    detector->detectAndCompute(gray, cv::noArray(), keypoints, descriptors);
+    workspace.track();
+    if (descriptors.empty()) {
+        return cv::Mat();
+    }
+
+    // Match descriptors using FLANN
+    FlannBasedMatcher matcher;
+    std::vector<std::vector<cv::DMatch>>& knnMatches = workspace.knnMatches;
+    knnMatches.clear();
+    matcher.knnMatch(alignmentBase.descriptors, descriptors, knnMatches, 2); // Find the 2 nearest neighbors
+
+    // Filter good matches using Lowe's ratio test and extract their locations
+    std::vector<Point2f>& pointsRef = workspace.pointsRef;
+    std::vector<Point2f>& pointsCur = workspace.pointsCur;
+    pointsRef.clear();
+    pointsCur.clear();
+    const float ratioThresh = 0.75f; // Lowe's ratio test threshold
+    for (const auto& knnMatch : knnMatches) {
+        if (knnMatch.size() >= 2 && knnMatch[0].distance < ratioThresh * knnMatch[1].distance) {
+            pointsRef.push_back(alignmentBase.keypoints[knnMatch[0].queryIdx].pt);
+            pointsCur.push_back(keypoints[knnMatch[0].trainIdx].pt);
+        }
+    }
+
+    //Make sure there are enough points to find homography
+    if(pointsCur.size() < 4 || pointsRef.size() < 4){
+        std::cerr << "Not enough points to find homography" << std::endl;
+        return cv::Mat();
+    }
+
+    return cv::estimateAffinePartial2D(pointsCur, pointsRef, cv::noArray(), cv::RANSAC);
+}
+
+/// Computes the sharpness of every pixel of an image as the local variance of its laplacian
+/// \param image The aligned image
+/// \param laplaceKernelSize The window size for the laplacian variance
+/// \param workspace The buffers of the calling thread, the result lives in it until the next call
+/// \return The sharpness map (CV_64F)
+const cv::Mat& ImageProcessing::compute_sharpness(const cv::Mat& image, int laplaceKernelSize, ScoreWorkspace& workspace) {
+    //Convert to grayscale
+    cv::cvtColor(image, workspace.gray, cv::COLOR_BGR2GRAY);
+
+    cv::GaussianBlur(workspace.gray, workspace.gaussian, cv::Size(3,3), 0);
+    cv::Laplacian(workspace.gaussian, workspace.laplacian, CV_64F, 1);
+
+    //Compute the local variance of the laplacian
+    compute_local_variance(workspace.laplacian, workspace.sharpness, laplaceKernelSize, workspace);
+    workspace.track();
+    return workspace.sharpness;
 }
 
-/// Aligns images using SIFT feature matching and homography estimation
-/// \param images The images to align
-/// \return The aligned images
-std::vector<cv::Mat> ImageProcessing::align_images(const std::vector<cv::Mat>& images) {
-    if (images.empty()) {
+/// Folds the sharpness of one layer into the running depth map
+/// \param sharpness The sharpness map of the layer
+/// \param layer The index of the layer
+/// \param sharpnessMax The highest sharpness seen so far for each pixel
+/// \param depthMap The index of the sharpest layer so far for each pixel (CV_16U)
+void ImageProcessing::update_depth_map(const cv::Mat& sharpness, int layer, cv::Mat& sharpnessMax, cv::Mat& depthMap) {
+    int rows = sharpness.rows;
+    int cols = sharpness.cols;
+
+    //Layers may arrive out of order, ties go to the higher layer as if the layers were processed in order
+    const Kernels& k = kernels();
+    for(int r = 0; r < rows; r++){
+        k.update_depth_row(sharpness.ptr<double>(r), sharpnessMax.ptr<double>(r), depthMap.ptr<ushort>(r), cols, static_cast<ushort>(layer));
+    }
+}
+
+/// Checks whether a transform leaves a layer where it is. Translations are estimated to sub pixel
+/// precision, so a layer that did not move rarely gets an exact identity.
+/// \param transform The 2x3 affine transform
+/// \return Whether no entry is further than 1e-3 from the identity
+bool ImageProcessing::is_identity(const cv::Mat& transform) {
+    return !transform.empty() && cv::norm(transform, cv::Mat::eye(2, 3, transform.type()), cv::NORM_INF) < 1e-3;
+}
+
+/// Copies the pixels of a layer that is the sharpest layer in a band of the depth map into a composite.
+/// Each depth map pixel covers a block of depthScale x depthScale layer pixels.
+/// \param image The aligned layer at full resolution
+/// \param depthMap The depth map (CV_16U layer indices)
+/// \param layer The index of the layer
+/// \param depthScale The depth map resolution divisor
+/// \param top The first depth map row of the band
+/// \param bottom The depth map row after the band
+/// \param composite The composite (same size and type as the layer)
+void ImageProcessing::copy_winning_pixels(const cv::Mat& image, const cv::Mat& depthMap, ushort layer, int depthScale, int top, int bottom, cv::Mat& composite) {
+    const size_t pixelBytes = image.elemSize();
+    for (int y = top * depthScale; y < std::min(image.rows, bottom * depthScale); y++) {
+        const ushort* depthRow = depthMap.ptr<ushort>(y / depthScale);
+        const uchar* source = image.ptr<uchar>(y);
+        uchar* target = composite.ptr<uchar>(y);
+        for (int x = 0; x < image.cols; x++) {
+            if (depthRow[x / depthScale] == layer) {
+                std::memcpy(target + x * pixelBytes, source + x * pixelBytes, pixelBytes);
+            }
+        }
+    }
+}
+
+/// Runs the decode, align and score stages concurrently. Each stage has its own worker threads and
+/// the stages are connected by bounded queues, so layer N is scored while layer N+1 is aligned and
+/// layer N+2 is decoded.
+/// \param source The frames to process, frame 0 is the base image
+/// \param storedTransforms Transforms from an earlier run, if given no features are matched
+/// \param params The stacking parameters
+/// \param score Whether to compute the depth map, otherwise the layers are only aligned
+/// \param config The number of threads per stage
+/// \param keepLayers Whether to keep the aligned layers, streamed stacks only keep the transforms
+/// \param priorTransforms Transforms of a similar earlier stack, each is refined by phase correlation
+/// and the layer is only matched by features if the refinement does not fit
+/// \return The aligned layers, their transforms and the raw depth map
+StackLayers ImageProcessing::run_pipeline(FrameSource& source, const std::vector<cv::Mat>* storedTransforms, const StackParameters& params, bool score, const PipelineConfig& config, bool keepLayers, const std::vector<cv::Mat>* priorTransforms) {
+    StackLayers result;
+
+    //The first frame is the base image that every other frame is aligned to
+    int baseIndex = 0;
+    cv::Mat base;
+    if (!source.next(baseIndex, base) || base.empty()) {
         std::cerr << "No images provided for alignment." << std::endl;
-        return {};
-    }
-
-    cv::Ptr<SIFT> detector = cv::SIFT::create( );
-
-    //Assume image 0 is base image
-    std::vector<cv::Mat> outImages;
-    outImages.push_back(images[0]); // Base image
-
-    // Process base image
-    cv::Mat baseGray;
-    cv::cvtColor(images[0], baseGray, cv::COLOR_BGR2GRAY);
-    cv::equalizeHist(baseGray, baseGray);
-    std::vector<cv::KeyPoint> baseKeypoints;
-    cv::Mat baseDescriptors;
-    detector->detectAndCompute(baseGray, cv::noArray(), baseKeypoints, baseDescriptors);
-
-    emit progress("Aligning images.",0,images.size()-1);
-    // Process remaining images
-    for (size_t i = 1; i < images.size(); ++i) {
-        std::cout << "Aligning image " << i << std::endl;
-
-        std::vector<cv::KeyPoint> keypoints;
-        cv::Mat descriptors;
-        cv::Mat gray;
-        cv::cvtColor(images[i], gray, cv::COLOR_BGR2GRAY);
-        cv::equalizeHist(gray, gray);
-
-        detector->detectAndCompute(gray, cv::noArray(), keypoints, descriptors);
-
-        // Match descriptors using FLANN
-        FlannBasedMatcher matcher;
-        std::vector<std::vector<cv::DMatch>> knnMatches;
-        matcher.knnMatch(baseDescriptors, descriptors, knnMatches, 2); // Find the 2 nearest neighbors
-
-        // Filter good matches using Lowe's ratio test
-        std::vector<cv::DMatch> goodMatches;
-        const float ratioThresh = 0.75f; // Lowe's ratio test threshold
-        for (const auto& knnMatch : knnMatches) {
-            if (knnMatch.size() >= 2 && knnMatch[0].distance < ratioThresh * knnMatch[1].distance) {
-                goodMatches.push_back(knnMatch[0]);
+        return result;
+    }
+
+    bool align = storedTransforms == nullptr;
+
+    //A single pass composite copies pixels from the full resolution aligned layers as they are scored
+    bool singlePass = score && params.singlePass && !params.blendLayers;
+    bool deferWarp = params.deferredWarp && !singlePass;
+
+    AlignmentBase alignmentBase;
+    if (align && !prepare_alignment_base(base, alignmentBase, params.translationFirst || priorTransforms != nullptr)) {
+        std::cerr << "No features found in the base image." << std::endl;
+    }
+
+    //OpenCV's thread count is global, pipelines that run side by side leave it to their caller
+    int previousThreads = cv::getNumThreads();
+    if (config.opencvThreads > 0) {
+        cv::setNumThreads(config.opencvThreads);
+    }
+
+    //Streamed sources may not know their length, the progress bar is then shown as busy
+    int total = std::max(0, source.count());
+    std::mutex resultMutex;
+    std::map<int, cv::Mat> alignedImages;
+    std::map<int, cv::Mat> transforms;
+    alignedImages[baseIndex] = base;
+    transforms[baseIndex] = cv::Mat::eye(2, 3, CV_64F);
+
+    //The depth map is a low frequency signal, so it may be estimated at a reduced resolution.
+    //The variance window is scaled along so that it covers the same image area.
+    int depthScale = std::max(1, params.depthScale);
+    cv::Size depthSize((base.cols + depthScale - 1) / depthScale, (base.rows + depthScale - 1) / depthScale);
+    int scoringKernelSize = depthScale > 1 ? std::max(3, (params.laplaceKernelSize / depthScale) | 1) : params.laplaceKernelSize;
+
+    cv::Mat sharpnessMax = cv::Mat::zeros(depthSize, CV_64F);
+    cv::Mat depthMap = cv::Mat::zeros(depthSize, CV_16U);
+    cv::Mat composite = singlePass ? base.clone() : cv::Mat();
+
+    //Each band of depth map rows has its own lock, layers scored at the same time update different bands
+    //instead of waiting for each other. In single pass mode a band also guards its rows of the composite.
+    const int bandCount = std::max(1, std::min(depthSize.height, 32));
+    const int bandRows = (depthSize.height + bandCount - 1) / bandCount;
+    std::vector<std::mutex> bandMutexes(bandCount);
+    std::mutex previewMutex;
+    std::chrono::steady_clock::time_point lastPreview; // Previews are throttled, the first one is shown at once
+
+    std::atomic<int> alignedCount{0};
+    std::atomic<int> scoredCount{0};
+    std::atomic<size_t> alignAllocations{0};
+    std::atomic<size_t> scoreAllocations{0};
+
+    BoundedQueue<PipelineFrame> decodedQueue(config.queueCapacity);
+    BoundedQueue<PipelineFrame> alignedQueue(config.queueCapacity);
+    StageCounter decodeCounter(config.decodeThreads);
+    StageCounter alignCounter(config.alignThreads);
+
+    emit progress("Aligning images.",0,std::max(0, total-1));
+
+    //The base image needs no alignment and goes straight to scoring
+    if (score) {
+        alignedQueue.push(PipelineFrame(baseIndex, cv::Mat(base)));
+    }
+
+    std::vector<std::thread> workers;
+
+    //Decode stage
+    for (int t = 0; t < config.decodeThreads; t++) {
+        workers.emplace_back([&]() {
+            int index;
+            cv::Mat frame;
+            while (source.next(index, frame)) {
+                if (frame.empty() || frame.size() != base.size()) {
+                    std::cerr << "Skipping image " << index << ", it is missing or differs in size from the base image" << std::endl;
+                    continue;
+                }
+                decodedQueue.push(PipelineFrame(index, std::move(frame)));
             }
+            decodeCounter.finished(decodedQueue);
+        });
+    }
+
+    //Align stage
+    for (int t = 0; t < config.alignThreads; t++) {
+        workers.emplace_back([&]() {
+            //The detector keeps internal buffers so every thread needs its own
+            cv::Ptr<SIFT> detector = align ? cv::SIFT::create( ) : cv::Ptr<SIFT>();
+            AlignWorkspace workspace;
+            PipelineFrame item;
+            while (decodedQueue.pop(item)) {
+                std::cout << "Aligning image " << item.index << std::endl;
+
+                cv::Mat H;
+                if (align && priorTransforms != nullptr && item.index < static_cast<int>(priorTransforms->size()) && !(*priorTransforms)[item.index].empty()) {
+                    H = estimate_translation(item.image, alignmentBase, workspace, (*priorTransforms)[item.index]);
+                    if (H.empty()) {
+                        std::cout << "Prior transform does not fit image " << item.index << ", aligning it again" << std::endl;
+                    }
+                }
+                if (align && H.empty()) {
+                    H = estimate_alignment(item.image, alignmentBase, detector, workspace, params.translationFirst);
+                }
+                else if (!align && item.index < static_cast<int>(storedTransforms->size())) {
+                    H = (*storedTransforms)[item.index];
+                }
+
+                //With deferred warping the original frame is kept and only the scoring image is warped,
+                //onto the depth grid and not at all for layers that did not move. The composite samples
+                //the original through the transform.
+                cv::Mat aligned;
+                if (!H.empty() && deferWarp) {
+                    if (score) {
+                        cv::Mat reduced = item.image;
+                        cv::Mat reducedH = H.clone();
+                        if (depthScale > 1) {
+                            reduce_to_depth_grid(item.image, reduced, depthScale);
+                            reducedH.col(2) /= depthScale;
+                        }
+                        if (is_identity(H)) {
+                            aligned = reduced;
+                        }
+                        else {
+                            warpAffine(reduced, aligned, reducedH, depthSize, cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+                        }
+                    }
+                    else {
+                        aligned = item.image;
+                    }
+                }
+                else if (is_identity(H)) {
+                    //Layers that did not move need no resampling
+                    aligned = item.image;
+                }
+                else if (!H.empty()) {
+                    warpAffine(item.image, aligned, H, base.size(), cv::INTER_CUBIC, cv::BORDER_REPLICATE);
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(resultMutex);
+                    transforms[item.index] = H;
+                    if (!aligned.empty()) {
+                        alignedImages[item.index] = !keepLayers ? cv::Mat() : (deferWarp ? item.image : aligned);
+                    }
+                }
+
+                emit progress("Aligning images.",++alignedCount,std::max(0, total-1));
+                if (aligned.empty()) {
+                    continue;
+                }
+                emit renderImage(aligned);
+
+                if (score) {
+                    alignedQueue.push(PipelineFrame(item.index, std::move(aligned)));
+                }
+            }
+            alignAllocations += workspace.allocations;
+            alignCounter.finished(alignedQueue);
+        });
+    }
+
+    //Score stage
+    if (score) {
+        for (int t = 0; t < config.scoreThreads; t++) {
+            workers.emplace_back([&]() {
+                ScoreWorkspace workspace;
+                PipelineFrame item;
+                while (alignedQueue.pop(item)) {
+                    std::cout << "Processing layer " << item.index << std::endl;
+                    cv::Mat scoringImage = item.image;
+                    if (item.image.size() != depthSize) {
+                        reduce_to_depth_grid(item.image, workspace.scoring, depthScale);
+                        scoringImage = workspace.scoring;
+                    }
+                    const cv::Mat& sharpness = compute_sharpness(scoringImage, scoringKernelSize, workspace);
+
+                    //Fold the layer into the depth map one band at a time, the pixels whose sharpest layer is
+                    //now this layer take its pixels while the band is still locked
+                    const Kernels& k = kernels();
+                    for (int band = 0; band < bandCount; band++) {
+                        int top = band * bandRows;
+                        int bottom = std::min(depthSize.height, top + bandRows);
+                        std::lock_guard<std::mutex> lock(bandMutexes[band]);
+                        for (int r = top; r < bottom; r++) {
+                            k.update_depth_row(sharpness.ptr<double>(r), sharpnessMax.ptr<double>(r), depthMap.ptr<ushort>(r), depthSize.width, static_cast<ushort>(item.index));
+                        }
+                        if (singlePass) {
+                            copy_winning_pixels(item.image, depthMap, static_cast<ushort>(item.index), depthScale, top, bottom, composite);
+                        }
+                    }
+
+                    //Render progress, copying the full composite for every layer would slow down deep stacks.
+                    //The preview is handed to the UI thread, so it can not be a reused buffer.
+                    cv::Mat dMapProgress;
+                    cv::Mat compositeProgress;
+                    bool showPreview = false;
+                    {
+                        std::lock_guard<std::mutex> lock(previewMutex);
+                        auto now = std::chrono::steady_clock::now();
+                        if (now - lastPreview > std::chrono::milliseconds(250)) {
+                            showPreview = true;
+                            lastPreview = now;
+                        }
+                    }
+                    if (showPreview) {
+                        cv::Mat snapshot = singlePass ? composite : depthMap;
+                        cv::Mat copy(snapshot.size(), snapshot.type());
+                        int rowScale = singlePass ? depthScale : 1;
+                        for (int band = 0; band < bandCount; band++) {
+                            int top = std::min(snapshot.rows, band * bandRows * rowScale);
+                            int bottom = std::min(snapshot.rows, (band + 1) * bandRows * rowScale);
+                            std::lock_guard<std::mutex> lock(bandMutexes[band]);
+                            snapshot.rowRange(top, bottom).copyTo(copy.rowRange(top, bottom));
+                        }
+                        if (singlePass) {
+                            compositeProgress = copy;
+                        }
+                        else {
+                            cv::normalize(copy, dMapProgress, 0, 255, cv::NORM_MINMAX, CV_8U);
+                        }
+                    }
+                    if (!dMapProgress.empty()) {
+                        emit renderImage(dMapProgress, true);
+                    }
+                    if (!compositeProgress.empty()) {
+                        emit renderImage(compositeProgress);
+                    }
+                    emit progress("Generating depth map.",++scoredCount, total);
+                }
+                scoreAllocations += workspace.allocations;
+            });
         }
+    }
 
-        // Extract location of good matches
-        std::vector<Point2f> pointsRef, pointsCur;
-        for (const auto& match : goodMatches) {
-            pointsRef.push_back(baseKeypoints[match.queryIdx].pt);
-            pointsCur.push_back(keypoints[match.trainIdx].pt);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (config.opencvThreads > 0) {
+        cv::setNumThreads(previousThreads);
+    }
+
+    //Buffers are allocated once per worker and again only when a layer needs a larger one
+    std::cout << "Workspace allocations: " << alignAllocations << " in alignment of " << alignedCount << " layers, "
+              << scoreAllocations << " in depth estimation of " << scoredCount << " layers" << std::endl;
+
+    //Drop the layers that do not win a single pixel, they can not contribute to the composite
+    if (score && params.pruneLayers) {
+        std::vector<int> wins(std::max(source.count(), alignedImages.rbegin()->first + 1), 0);
+        for (int r = 0; r < depthMap.rows; r++) {
+            const ushort* depthRow = depthMap.ptr<ushort>(r);
+            for (int c = 0; c < depthMap.cols; c++) {
+                wins[depthRow[c]]++;
+            }
         }
 
-        //Make sure there are enough points to find homography
-        if(pointsCur.size() < 4 || pointsRef.size() < 4){
-            std::cerr << "Not enough points to find homography" << std::endl;
-            continue;
+        for (auto image = alignedImages.begin(); image != alignedImages.end();) {
+            if (image->first != baseIndex && wins[image->first] == 0) {
+                result.unusedLayers.push_back(image->first);
+                result.freedBytes += image->second.total() * image->second.elemSize();
+                transforms[image->first] = cv::Mat();
+                image = alignedImages.erase(image);
+            }
+            else {
+                ++image;
+            }
+        }
+    }
+
+    //Collect the layers in input order and leave out the ones that could not be aligned
+    int frameCount = std::max(source.count(), transforms.empty() ? 0 : transforms.rbegin()->first + 1);
+    std::vector<ushort> layerLut(frameCount, 0);
+    result.transforms.resize(frameCount);
+    for (int i = 0; i < frameCount; i++) {
+        auto transform = transforms.find(i);
+        if (transform != transforms.end()) {
+            result.transforms[i] = transform->second;
         }
+        auto image = alignedImages.find(i);
+        if (image != alignedImages.end()) {
+            layerLut[i] = static_cast<ushort>(result.layerCount++);
+            if (keepLayers) {
+                result.images.push_back(image->second);
+            }
+            if (keepLayers && deferWarp) {
+                result.layerTransforms.push_back(transforms[i]);
+            }
+        }
+    }
 
+    result.baseImage = base;
+    result.composite = composite;
 
-        // Warp the current image to align with the reference
-        Mat aligned;
-        Mat H = cv::estimateAffinePartial2D(pointsCur, pointsRef, cv::noArray(), cv::RANSAC);
-        warpAffine(images[i], aligned, H, images[0].size(), cv::INTER_CUBIC, cv::BORDER_REPLICATE);
-        outImages.push_back(aligned);
-        emit renderImage(aligned);
-        emit progress("Aligning images.",i,images.size()-1);
+    //The depth map holds input indices, map them to indices into the collected layers
+    if (score) {
+        result.rawDepthMap.create(depthMap.size(), CV_16U);
+        for (int r = 0; r < depthMap.rows; r++) {
+            const ushort* depthRow = depthMap.ptr<ushort>(r);
+            ushort* rawRow = result.rawDepthMap.ptr<ushort>(r);
+            for (int c = 0; c < depthMap.cols; c++) {
+                rawRow[c] = layerLut[depthRow[c]];
+            }
+        }
     }
 
-    return outImages;
+    return result;
 }
 
-/// Computes the depth map from a stack of images
-/// \param images The images to compute the depth map from
-/// \param estimationRadius The radius for the laplacian estimation
-/// \param smoothRadius The radius for the gaussian smoothing
-/// \param contrastThreshold The threshold for the laplacian variance
-///
-cv::Mat ImageProcessing::compute_depth_map(const std::vector<cv::Mat>& images, int laplaceKernelSize, int smoothKernelSize, int smoothStrength, int smoothIterations){
-    int rows = images[0].rows;
-    int cols = images[0].cols;
+/// Finds frames that are not worth aligning using cheap thumbnails. A frame is redundant if it is
+/// a near duplicate of the previous frame and not sharper, or if it is much less sharp than both of
+/// its neighbours, which is what motion blur looks like in an otherwise smooth focus sweep.
+/// \param source The frames of the stack
+/// \param reasons Receives a description of each redundant frame
+/// \return The indices of the redundant frames
+std::vector<int> ImageProcessing::find_redundant_frames(FrameSource& source, QStringList& reasons) {
+    const double duplicateThreshold = 1.0; // Mean absolute difference in gray levels
+    const double blurRatio = 0.5;          // Sharpness relative to the less sharp neighbour
 
-    cv::Mat depthMap = cv::Mat::zeros(rows, cols, CV_8U);
-    cv::Mat sharpnessMax = cv::Mat::zeros(rows, cols, CV_64F);
+    std::vector<int> redundant;
+    int count = source.count();
+    if (count < 3) {
+        return redundant;
+    }
 
-    emit progress("Generating depth map.",0, images.size());
-    //Iterate through each layer in the stack calculating laplacian variance for each pixel and storing the maximum value
-    for(int layer = 0; layer < images.size(); layer++){
-        std::cout << "Processing layer " << layer << std::endl;
-        cv::Mat image = images[layer];
+    emit progress("Checking layers.", 0, count);
+    std::vector<cv::Mat> thumbnails(count);
+    std::vector<double> sharpness(count, 0.0);
+    for (int i = 0; i < count; i++) {
+        thumbnails[i] = source.thumbnail(i);
+        if (thumbnails[i].empty()) {
+            //Pruning is only possible if every frame has a thumbnail
+            return redundant;
+        }
 
-        //Convert to grayscale
-        cv::Mat gray;
-        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+        cv::Mat laplacian;
+        cv::Scalar mean, stddev;
+        cv::Laplacian(thumbnails[i], laplacian, CV_64F);
+        cv::meanStdDev(laplacian, mean, stddev);
+        sharpness[i] = stddev[0] * stddev[0];
+        emit progress("Checking layers.", i + 1, count);
+    }
 
-        cv::Mat sharpness,laplacian, gaussian;
-        cv::GaussianBlur(gray,gaussian,cv::Size(3,3),0);
-        cv::Laplacian(gaussian, laplacian, CV_64F, 1);
+    std::vector<bool> dropped(count, false);
 
-        //Compute the local variance of the laplacian
-        compute_local_variance(laplacian, sharpness, laplaceKernelSize);
+    //Motion blurred frames, the first and last frame have only one neighbour and are kept
+    for (int i = 1; i < count - 1; i++) {
+        if (sharpness[i] < blurRatio * std::min(sharpness[i - 1], sharpness[i + 1])) {
+            dropped[i] = true;
+            reasons << QString("Layer %1: blurred").arg(i + 1);
+        }
+    }
 
-        for(int r = 0; r < rows; r++){
-            for(int c = 0; c < cols; c++){
-                double sharpnessValue = sharpness.at<double>(r,c);
-                if( sharpnessValue >= sharpnessMax.at<double>(r,c)){
-                    sharpnessMax.at<double>(r,c) = sharpnessValue;
-                    depthMap.at<uchar>(r,c) = static_cast<uchar>(layer);
-                }
+    //Near duplicates of the previous kept frame, the base frame is never dropped
+    int previous = 0;
+    for (int i = 1; i < count; i++) {
+        if (dropped[i]) {
+            continue;
+        }
+        if (thumbnails[i].size() == thumbnails[previous].size() && cv::norm(thumbnails[i], thumbnails[previous], cv::NORM_L1) / thumbnails[i].total() < duplicateThreshold) {
+            if (sharpness[i] <= sharpness[previous] || previous == 0) {
+                dropped[i] = true;
+                reasons << QString("Layer %1: duplicate of layer %2").arg(i + 1).arg(previous + 1);
+                continue;
             }
+            dropped[previous] = true;
+            reasons << QString("Layer %1: duplicate of layer %2").arg(previous + 1).arg(i + 1);
         }
+        previous = i;
+    }
 
-        //Render depth map progress
-        cv::Mat dMapProgress = depthMap.clone();
-        //Normalize the depth map for visualization
-        cv::normalize(dMapProgress, dMapProgress, 0, 255, cv::NORM_MINMAX);
-        emit renderImage(dMapProgress, true);
-        emit progress("Generating depth map.",layer+1, images.size());
+    for (int i = 0; i < count; i++) {
+        if (dropped[i]) {
+            redundant.push_back(i);
+        }
     }
-    //Convert depth map to flaat before smoothing
-    depthMap.convertTo(depthMap, CV_32F);
+    return redundant;
+}
+
+/// Reduces an image to the depth map resolution. Every depth pixel is the mean of a block of
+/// depthScale x depthScale pixels, the blocks at the right and bottom edge are completed with the
+/// edge pixels, so a crop that starts on the block grid reduces to the same pixels as the full frame.
+/// \param image The full resolution image
+/// \param reduced The reduced image, ceil(size / depthScale)
+/// \param depthScale The depth map downscale factor
+void ImageProcessing::reduce_to_depth_grid(const cv::Mat& image, cv::Mat& reduced, int depthScale){
+    cv::Size depthSize((image.cols + depthScale - 1) / depthScale, (image.rows + depthScale - 1) / depthScale);
+    int padRight = depthSize.width * depthScale - image.cols;
+    int padBottom = depthSize.height * depthScale - image.rows;
+    if (padRight == 0 && padBottom == 0) {
+        cv::resize(image, reduced, depthSize, 0, 0, cv::INTER_AREA);
+        return;
+    }
+    cv::Mat padded;
+    cv::copyMakeBorder(image, padded, 0, padBottom, 0, padRight, cv::BORDER_REPLICATE);
+    cv::resize(padded, reduced, depthSize, 0, 0, cv::INTER_AREA);
+}
+
+/// Returns the number of fractional bits of the 16 bit fixed point depth map. Deep stacks need more
+/// bits for the layer index and keep fewer for blending between layers.
+/// \param layerCount The number of layers
+/// \return The number of fractional bits, between 0 and 8
+int ImageProcessing::depth_fraction_bits(int layerCount){
+    int bits = 8;
+    while (bits > 0 && (static_cast<long>(std::max(1, layerCount - 1)) << bits) > 65535) {
+        bits--;
+    }
+    return bits;
+}
+
+/// Smooths a raw depth map using repeated bilateral filtering. The depth map is kept as 16 bit fixed
+/// point and only converted to float one strip at a time while it is filtered.
+/// \param rawDepthMap The raw depth map from the pipeline
+/// \param smoothKernelSize The kernel size for the smoothing
+/// \param smoothStrength The strength of the smoothing
+/// \param smoothIterations The number of smoothing iterations
+/// \param depthScale The depth map resolution divisor, the spatial kernel is scaled along with it
+/// \param fractionBits The number of fractional bits of the result
+/// \return The smoothed depth map (CV_16U fixed point)
+cv::Mat ImageProcessing::smooth_depth_map(const cv::Mat& rawDepthMap, int smoothKernelSize, int smoothStrength, int smoothIterations, int depthScale, int fractionBits){
+    const double fixedScale = 1 << fractionBits;
+
+    //Convert the layer indices to fixed point
+    cv::Mat depthMap;
+    rawDepthMap.convertTo(depthMap, CV_16U, fixedScale);
 
     //SMooth depth map using bilateral filtering
-    cv::Mat depthMapSmoothed;
+    cv::Mat depthMapSmoothed = depthMap.clone();
     emit progress("Smoothening depth map.", 0, smoothIterations);
     for(int i = 0; i < smoothIterations; i++){
-         cv::bilateralFilter(depthMap, depthMapSmoothed, smoothKernelSize, smoothStrength, smoothStrength);
+         smoothing_pass(depthMap, depthMapSmoothed, smoothKernelSize, smoothStrength, depthScale, fractionBits);
          depthMapSmoothed.copyTo(depthMap);
          emit progress("Smoothening depth map.", i+1, smoothIterations);
-         //Render the soothened depth map
-         cv::Mat dMapProgress = depthMapSmoothed.clone();
 
-         //Normalize the depth map for visualization
-         cv::normalize(dMapProgress, dMapProgress, 0, 255, cv::NORM_MINMAX);
+         //Render the soothened depth map, normalized to 8 bit for visualization
+         cv::Mat dMapProgress;
+         cv::normalize(depthMapSmoothed, dMapProgress, 0, 255, cv::NORM_MINMAX, CV_8U);
          emit renderImage(dMapProgress, true);
     }
 
     return depthMapSmoothed;
 }
 
+/// Runs one bilateral filtering pass over a fixed point depth map, one strip at a time
+/// \param depthMap The depth map (CV_16U fixed point)
+/// \param smoothed Receives the filtered depth map, allocated by the caller
+/// \param smoothKernelSize The kernel size for the smoothing at full resolution
+/// \param smoothStrength The strength of the smoothing
+/// \param depthScale The depth map resolution divisor, the spatial kernel is scaled along with it
+/// \param fractionBits The number of fractional bits of the depth map
+void ImageProcessing::smoothing_pass(const cv::Mat& depthMap, cv::Mat& smoothed, int smoothKernelSize, int smoothStrength, int depthScale, int fractionBits){
+    const double fixedScale = 1 << fractionBits;
+    const int stripRows = 256;
+
+    //Scale the spatial part of the filter to the depth map resolution
+    depthScale = std::max(1, depthScale);
+    int kernelSize = depthScale > 1 ? std::max(1, (smoothKernelSize / depthScale) | 1) : smoothKernelSize;
+    double sigmaSpace = static_cast<double>(smoothStrength) / depthScale;
+    int halo = kernelSize / 2 + 1;
+
+    //Each strip is filtered with enough rows around it that no pixel of the strip misses a neighbour.
+    //The range table of the filter follows the values of each strip, so the result may differ from
+    //filtering the whole map by the interpolation error of that table.
+    for(int top = 0; top < depthMap.rows; top += stripRows){
+        int bottom = std::min(depthMap.rows, top + stripRows);
+        int haloTop = std::max(0, top - halo);
+        int haloBottom = std::min(depthMap.rows, bottom + halo);
+
+        cv::Mat strip, filtered;
+        depthMap.rowRange(haloTop, haloBottom).convertTo(strip, CV_32F, 1.0 / fixedScale);
+        cv::bilateralFilter(strip, filtered, kernelSize, smoothStrength, sigmaSpace);
+
+        cv::Mat outputRows = smoothed.rowRange(top, bottom);
+        filtered.rowRange(top - haloTop, bottom - haloTop).convertTo(outputRows, CV_16U, fixedScale);
+    }
+}
+
+/// Smooths a raw depth map of a stack in a series, reusing the smoothed depth map of the previous
+/// stack wherever the raw depth maps agree. Smoothing is local, a pixel only depends on the raw
+/// depth within the reach of all passes, so tiles whose surroundings did not change keep the
+/// previous result. The result is close to smoothing the whole map but not identical, the range
+/// table of the bilateral filter is built from the values of each filtered area, so pixels near
+/// the edges of the recomputed tiles can differ by the interpolation error of that table.
+/// \param rawDepthMap The raw depth map from the pipeline
+/// \param prior The depth maps of the previous stack, smoothed with the same parameters
+/// \param params The stacking parameters
+/// \param fractionBits The number of fractional bits of the result
+/// \return The smoothed depth map (CV_16U fixed point)
+cv::Mat ImageProcessing::smooth_depth_map_with_prior(const cv::Mat& rawDepthMap, const SeriesPrior& prior, const StackParameters& params, int fractionBits){
+    if (prior.rawDepthMap.size() != rawDepthMap.size() || prior.smoothedDepthMap.size() != rawDepthMap.size()) {
+        return smooth_depth_map(rawDepthMap, params.smoothKernelSize, params.smoothStrength, params.smoothIterations, params.depthScale, fractionBits);
+    }
+
+    //How far a change of the raw depth spreads through all passes
+    int depthScale = std::max(1, params.depthScale);
+    int kernelSize = depthScale > 1 ? std::max(1, (params.smoothKernelSize / depthScale) | 1) : params.smoothKernelSize;
+    int reach = params.smoothIterations * (kernelSize / 2 + 1);
+
+    const int tileSize = 256;
+    cv::Mat changed = rawDepthMap != prior.rawDepthMap;
+    cv::Rect mapRect(cv::Point(0, 0), rawDepthMap.size());
+    std::vector<cv::Rect> tiles;
+    double workArea = 0.0;
+    for (int y = 0; y < rawDepthMap.rows; y += tileSize) {
+        for (int x = 0; x < rawDepthMap.cols; x += tileSize) {
+            cv::Rect tile = cv::Rect(x, y, tileSize, tileSize) & mapRect;
+            cv::Rect influence = cv::Rect(tile.x - reach, tile.y - reach, tile.width + 2 * reach, tile.height + 2 * reach) & mapRect;
+            if (cv::countNonZero(changed(influence)) > 0) {
+                tiles.push_back(tile);
+                workArea += (cv::Rect(tile.x - 2 * reach, tile.y - 2 * reach, tile.width + 4 * reach, tile.height + 4 * reach) & mapRect).area();
+            }
+        }
+    }
+
+    //Smoothing tiles with their margins costs more than smoothing the whole map once most of it changed
+    if (workArea >= mapRect.area()) {
+        return smooth_depth_map(rawDepthMap, params.smoothKernelSize, params.smoothStrength, params.smoothIterations, params.depthScale, fractionBits);
+    }
+    std::cout << "Smoothing " << tiles.size() << " changed depth map tiles, reusing the rest" << std::endl;
+
+    //Errors from the edges of a work area travel at most the reach inwards, a margin of twice the reach keeps them out of the tile
+    const double fixedScale = 1 << fractionBits;
+    cv::Mat result = prior.smoothedDepthMap.clone();
+    emit progress("Smoothening depth map.", 0, static_cast<int>(tiles.size()));
+    for (size_t t = 0; t < tiles.size(); t++) {
+        const cv::Rect& tile = tiles[t];
+        cv::Rect work = cv::Rect(tile.x - 2 * reach, tile.y - 2 * reach, tile.width + 4 * reach, tile.height + 4 * reach) & mapRect;
+        cv::Mat depthMap, smoothed;
+        rawDepthMap(work).convertTo(depthMap, CV_16U, fixedScale);
+        smoothed = depthMap.clone();
+        for (int i = 0; i < params.smoothIterations; i++) {
+            smoothing_pass(depthMap, smoothed, params.smoothKernelSize, params.smoothStrength, params.depthScale, fractionBits);
+            smoothed.copyTo(depthMap);
+        }
+        depthMap(tile - work.tl()).copyTo(result(tile));
+        emit progress("Smoothening depth map.", static_cast<int>(t) + 1, static_cast<int>(tiles.size()));
+    }
+    return result;
+}
+
+/// Upsamples a low resolution depth map to the resolution of the layers using joint bilateral
+/// upsampling, depth edges follow the edges of the full resolution guide image
+/// \param depthMap The low resolution depth map (CV_16U fixed point)
+/// \param guideImage The full resolution guide image, usually the base layer
+/// \param depthScale The factor the depth map was estimated at, the ratio of the sizes is not exact for odd sizes
+/// \return The full resolution depth map (CV_16U fixed point)
+cv::Mat ImageProcessing::upsample_depth_map(const cv::Mat& depthMap, const cv::Mat& guideImage, int depthScale){
+    cv::Mat guide, lowGuide;
+    cv::cvtColor(guideImage, guide, cv::COLOR_BGR2GRAY);
+    int scaleX = std::max(1, depthScale);
+    int scaleY = scaleX;
+    reduce_to_depth_grid(guide, lowGuide, scaleX);
+
+    const int radius = 2;
+    const double sigmaSpatial = 1.0;  // In low resolution pixels
+    const double sigmaRange = 12.0;   // In gray levels
+
+    //The sub pixel offset of a full resolution pixel within its low resolution pixel repeats every
+    //scale pixels, so the spatial weights only have to be computed once per offset
+    auto spatialWeights = [&](int scale) {
+        std::vector<float> weights(scale * (2 * radius + 1));
+        for (int phase = 0; phase < scale; phase++) {
+            double offset = (phase + 0.5) / scale - 0.5;
+            for (int d = -radius; d <= radius; d++) {
+                double distance = d - offset;
+                weights[phase * (2 * radius + 1) + d + radius] = static_cast<float>(std::exp(-distance * distance / (2 * sigmaSpatial * sigmaSpatial)));
+            }
+        }
+        return weights;
+    };
+    std::vector<float> weightsX = spatialWeights(scaleX);
+    std::vector<float> weightsY = spatialWeights(scaleY);
+
+    float rangeWeights[256];
+    for (int i = 0; i < 256; i++) {
+        rangeWeights[i] = static_cast<float>(std::exp(-(i * i) / (2 * sigmaRange * sigmaRange)));
+    }
+
+    cv::Mat upsampled(guide.size(), CV_16U);
+    cv::parallel_for_(cv::Range(0, guide.rows), [&](const cv::Range& range) {
+        for (int r = range.start; r < range.end; r++) {
+            int cy = std::min(r / scaleY, depthMap.rows - 1);
+            const float* wy = &weightsY[(r % scaleY) * (2 * radius + 1)];
+            const uchar* guideRow = guide.ptr<uchar>(r);
+            ushort* outRow = upsampled.ptr<ushort>(r);
+
+            for (int c = 0; c < guide.cols; c++) {
+                int cx = std::min(c / scaleX, depthMap.cols - 1);
+                const float* wx = &weightsX[(c % scaleX) * (2 * radius + 1)];
+                int g = guideRow[c];
+
+                float sum = 0.0f, weightSum = 0.0f;
+                for (int dy = -radius; dy <= radius; dy++) {
+                    int y = std::clamp(cy + dy, 0, depthMap.rows - 1);
+                    const ushort* depthRow = depthMap.ptr<ushort>(y);
+                    const uchar* lowGuideRow = lowGuide.ptr<uchar>(y);
+                    for (int dx = -radius; dx <= radius; dx++) {
+                        int x = std::clamp(cx + dx, 0, depthMap.cols - 1);
+                        float w = wy[dy + radius] * wx[dx + radius] * rangeWeights[std::abs(g - lowGuideRow[x])];
+                        sum += w * depthRow[x];
+                        weightSum += w;
+                    }
+                }
+                outRow[c] = weightSum > 0.0f ? cv::saturate_cast<ushort>(sum / weightSum) : depthMap.at<ushort>(cy, cx);
+            }
+        }
+    });
+
+    return upsampled;
+}
+
+/// Smooths the raw depth map and brings it to the resolution of the layers
+/// \param rawDepthMap The raw depth map from the pipeline
+/// \param baseImage The full resolution base layer, used to guide the upsampling
+/// \param layerCount The number of layers the depth map indexes
+/// \param params The stacking parameters
+/// \return The smoothed full resolution depth map (CV_16U fixed point)
+cv::Mat ImageProcessing::create_depth_map(const cv::Mat& rawDepthMap, const cv::Mat& baseImage, int layerCount, const StackParameters& params){
+    cv::Mat depthMap = smooth_depth_map(rawDepthMap, params.smoothKernelSize, params.smoothStrength, params.smoothIterations, params.depthScale, depth_fraction_bits(layerCount));
+    if (depthMap.size() != baseImage.size()) {
+        emit progress("Upsampling depth map.", 0, 1);
+        depthMap = upsample_depth_map(depthMap, baseImage, params.depthScale);
+        emit progress("Upsampling depth map.", 1, 1);
+    }
+    return depthMap;
+}
+
 /// Creates a composite image from a depth map
 /// \param images The images to composite
-/// \param depthMap The depth map
+/// \param depthMap The depth map (CV_16U fixed point)
 /// \param blendLayers Whether to blend layers
 /// \return The composite image
 cv::Mat ImageProcessing::create_composite_image_from_depth_map(const std::vector<cv::Mat>& images, const cv::Mat& depthMap, bool blendLayers){
+    int numImages = images.size();
+    const float fixedScale = static_cast<float>(1 << depth_fraction_bits(numImages));
+
     //print max value of depthMap
     double min, max;
     cv::minMaxLoc(depthMap, &min, &max);
-    std::cout << "Max value of depth map: " << max << std::endl;
+    std::cout << "Max value of depth map: " << max / fixedScale << std::endl;
 
     cv::Mat composite = cv::Mat::zeros(images[0].size(), images[0].type());
 
-    int numImages = images.size();
-
     for(int r = 0; r < depthMap.rows; r++){
         for(int c = 0; c < depthMap.cols; c++){
-            float depthValue = depthMap.at<float>(r,c);
+            float depthValue = depthMap.at<ushort>(r,c) / fixedScale;
 
             if(blendLayers){
                 //Determine the lower and upper layer indices
@@ -232,7 +999,7 @@ cv::Mat ImageProcessing::create_composite_image_from_depth_map(const std::vector
             }
             else{
                 //Set layer index to the nearest integer value
-                int layer = static_cast<int>(std::round(depthValue));
+                int layer = std::clamp(static_cast<int>(std::round(depthValue)), 0, numImages-1);
                 composite.at<cv::Vec3b>(r,c) = images[layer].at<cv::Vec3b>(r,c);
             }
         }
@@ -241,22 +1008,908 @@ cv::Mat ImageProcessing::create_composite_image_from_depth_map(const std::vector
     return composite;
 }
 
-/// Focus stacks a set of images
-/// \param unalignedImages The images to focus stack
-/// \param laplaceKernelSize The kernel size for the laplacian
-/// \param smoothKernelSize The kernel size for the smoothing
-/// \param smoothStrength The strength of the smoothing
-/// \param smoothIterations The number of smoothing iterations
+/// Creates a composite image tile by tile from layers that have not been warped. Each tile only
+/// warps the layers its depth range refers to, so pixels of layers that never win are not resampled.
+/// \param images The original layers
+/// \param transforms The transform of each layer into the base image
+/// \param depthMap The depth map (CV_16U fixed point)
 /// \param blendLayers Whether to blend layers
-void ImageProcessing::focus_stack(const std::vector<cv::Mat>& unalignedImages,int laplaceKernelSize, int smoothKernelSize, int smoothStrength, int smoothIterations, bool blendLayers) {
-    std::vector<cv::Mat> images = align_images(unalignedImages);
+/// \param tileSize The tile edge in pixels
+/// \return The composite image
+cv::Mat ImageProcessing::create_composite_image_deferred(const std::vector<cv::Mat>& images, const std::vector<cv::Mat>& transforms, const cv::Mat& depthMap, bool blendLayers, int tileSize){
+    const int layerCount = static_cast<int>(images.size());
+    const int fractionBits = depth_fraction_bits(layerCount);
+    const int fixedScale = 1 << fractionBits;
+    const int tilesAcross = (depthMap.cols + tileSize - 1) / tileSize;
+    const int tilesDown = (depthMap.rows + tileSize - 1) / tileSize;
 
-    //Compute the depth map
-    cv::Mat depthMap = compute_depth_map(images,laplaceKernelSize,smoothKernelSize,smoothStrength,smoothIterations);
+    std::vector<bool> isIdentity(layerCount);
+    for (int i = 0; i < layerCount; i++) {
+        isIdentity[i] = is_identity(transforms[i]);
+    }
 
-    //Create the composite image from the depth map
-    cv::Mat output = create_composite_image_from_depth_map(images, depthMap, blendLayers);
+    cv::Mat composite(depthMap.size(), CV_8UC3);
+    std::atomic<int> tilesDone{0};
+    emit progress("Combining layers.", 0, tilesAcross * tilesDown);
+
+    const Kernels& k = kernels();
+    cv::parallel_for_(cv::Range(0, tilesAcross * tilesDown), [&](const cv::Range& range) {
+        cv::Mat accumulator, layerTile;
+        for (int t = range.start; t < range.end; t++) {
+            cv::Rect rect((t % tilesAcross) * tileSize, (t / tilesAcross) * tileSize, 0, 0);
+            rect.width = std::min(tileSize, depthMap.cols - rect.x);
+            rect.height = std::min(tileSize, depthMap.rows - rect.y);
+            cv::Mat depthTile = depthMap(rect);
+
+            //Only the layers between the lowest and the highest depth of the tile contribute
+            double minDepth, maxDepth;
+            cv::minMaxLoc(depthTile, &minDepth, &maxDepth);
+            int firstLayer = static_cast<int>(minDepth) >> fractionBits;
+            int lastLayer = std::min((static_cast<int>(maxDepth) >> fractionBits) + 1, layerCount - 1);
+
+            accumulator.create(rect.size(), CV_16UC3);
+            accumulator.setTo(cv::Scalar::all(0));
+            for (int layer = firstLayer; layer <= lastLayer; layer++) {
+                //Shift the transform so that it maps straight into the tile, layers that did not move need no warping
+                if (isIdentity[layer]) {
+                    layerTile = images[layer](rect);
+                }
+                else {
+                    cv::Mat H;
+                    transforms[layer].convertTo(H, CV_64F);
+                    H.at<double>(0, 2) -= rect.x;
+                    H.at<double>(1, 2) -= rect.y;
+                    cv::warpAffine(images[layer], layerTile, H, rect.size(), cv::INTER_CUBIC, cv::BORDER_REPLICATE);
+                }
+
+                for (int r = 0; r < rect.height; r++) {
+                    k.accumulate_layer_row(depthTile.ptr<ushort>(r), layerTile.ptr<uchar>(r), accumulator.ptr<ushort>(r), rect.width, layer, layerCount, fractionBits, blendLayers);
+                }
+            }
+
+            cv::Mat compositeTile = composite(rect);
+            accumulator.convertTo(compositeTile, CV_8UC3, 1.0 / fixedScale);
+            emit progress("Combining layers.", ++tilesDone, tilesAcross * tilesDown);
+        }
+    });
+
+    return composite;
+}
+
+/// Creates the composite of the output of the pipeline
+/// \param layers The layers, warped or with their transforms when warping was deferred
+/// \param depthMap The depth map (CV_16U fixed point)
+/// \param blendLayers Whether to blend layers
+/// \param tileSize The tile edge of the composite of layers whose warping was deferred
+/// \return The composite image
+cv::Mat ImageProcessing::composite_layers(const StackLayers& layers, const cv::Mat& depthMap, bool blendLayers, int tileSize){
+    if (!layers.layerTransforms.empty()) {
+        return create_composite_image_deferred(layers.images, layers.layerTransforms, depthMap, blendLayers, tileSize);
+    }
+    return create_composite_image_from_depth_map(layers.images, depthMap, blendLayers);
+}
+
+/// Stacks one slab of an ordered stack with the regular align, score and composite steps
+/// \param source The frames of the slab
+/// \param params The stacking parameters
+/// \param config The number of threads per stage
+/// \return The composite of the slab, empty if the slab could not be stacked
+cv::Mat ImageProcessing::stack_slab(FrameSource& source, const StackParameters& params, const PipelineConfig& config) {
+    if (params.pruneLayers) {
+        QStringList reasons;
+        for (int index : find_redundant_frames(source, reasons)) {
+            source.skip(index);
+        }
+    }
+
+    bool singlePass = params.singlePass && !params.blendLayers;
+    StackLayers layers = run_pipeline(source, nullptr, params, true, config, !singlePass);
+    if (layers.layerCount == 0) {
+        return cv::Mat();
+    }
+    if (singlePass) {
+        return layers.composite;
+    }
+
+    cv::Mat depthMap = create_depth_map(layers.rawDepthMap, layers.baseImage, layers.layerCount, params);
+    return composite_layers(layers, depthMap, params.blendLayers);
+}
+
+/// Splits an ordered stack into overlapping slabs and stacks them side by side
+/// \param count The number of frames in the stack
+/// \param params The stacking parameters
+/// \param makeSource Creates the frame source of the slab starting at a frame with a given length
+/// \return The composite of each slab in order, slabs that could not be stacked are left out
+std::vector<cv::Mat> ImageProcessing::stack_slab_level(int count, const StackParameters& params, const std::function<std::unique_ptr<FrameSource>(int, int)>& makeSource) {
+    int slabSize = std::max(2, params.slabSize);
+    int overlap = std::clamp(params.slabOverlap, 0, slabSize - 1);
+    int step = slabSize - overlap;
+
+    //The last slab runs to the end of the stack so that no slab is left with a single frame
+    std::vector<std::pair<int, int>> slabs;
+    for (int start = 0; start < count; start += step) {
+        int length = std::min(slabSize, count - start);
+        if (start + length >= count - 1) {
+            slabs.push_back({start, count - start});
+            break;
+        }
+        slabs.push_back({start, length});
+    }
+
+    //Run a few slabs at a time, each with a share of the cores. The memory use is bounded by
+    //the number of slabs in flight times the slab size.
+    int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    int slabWorkers = std::clamp(params.slabWorkers > 0 ? params.slabWorkers : cores / 4, 1, std::max(1, static_cast<int>(slabs.size())));
+    PipelineConfig config;
+    config.decodeThreads = 1;
+    config.alignThreads = std::max(1, cores / (2 * slabWorkers));
+    config.scoreThreads = std::max(1, cores / (4 * slabWorkers));
+    config.queueCapacity = pipelineConfig.queueCapacity;
+    config.opencvThreads = 0;
+
+    std::vector<cv::Mat> results(slabs.size());
+    std::atomic<int> nextSlab{0};
+    std::atomic<int> finished{0};
+    std::vector<std::thread> workers;
+    int slabCount = static_cast<int>(slabs.size());
+    emit progress("Stacking slabs.", 0, slabCount);
+    for (int t = 0; t < slabWorkers; t++) {
+        workers.emplace_back([&]() {
+            int slab;
+            while ((slab = nextSlab.fetch_add(1)) < slabCount) {
+                std::cout << "Stacking slab " << slab << " (frames " << slabs[slab].first << " to " << slabs[slab].first + slabs[slab].second - 1 << ")" << std::endl;
+                std::unique_ptr<FrameSource> source = makeSource(slabs[slab].first, slabs[slab].second);
+                results[slab] = stack_slab(*source, params, config);
+                emit progress("Stacking slabs.", ++finished, slabCount);
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    results.erase(std::remove_if(results.begin(), results.end(), [](const cv::Mat& result) { return result.empty(); }), results.end());
+    return results;
+}
+
+/// Stacks a deep stack hierarchically. The stack is split into overlapping slabs that are stacked
+/// independently, then the slab composites are stacked again until a single image remains.
+/// \param files The image files in focus order
+/// \param params The stacking parameters
+/// \return The composite image
+cv::Mat ImageProcessing::stack_slabs(const QStringList& files, const StackParameters& params) {
+    //The OpenCV thread count is left alone, run_pipeline only sets it around its own stages, so the
+    //smoothing, upsampling and compositing of each slab use all cores
+    std::vector<cv::Mat> results = stack_slab_level(files.size(), params, [&](int start, int length) {
+        return std::unique_ptr<FrameSource>(new ImageFileSource(files.mid(start, length)));
+    });
+
+    //Slab composites are stacked the same way until they fit in a single slab
+    int level = 1;
+    while (results.size() > static_cast<size_t>(std::max(2, params.slabSize))) {
+        std::cout << "Stacking slab level " << level++ << " with " << results.size() << " images" << std::endl;
+        std::vector<cv::Mat> levelImages = results;
+        results = stack_slab_level(static_cast<int>(levelImages.size()), params, [&](int start, int length) {
+            return std::unique_ptr<FrameSource>(new MatSource(std::vector<cv::Mat>(levelImages.begin() + start, levelImages.begin() + start + length)));
+        });
+    }
+
+    cv::Mat output;
+    if (results.size() == 1) {
+        output = results[0];
+    }
+    else if (!results.empty()) {
+        MatSource source(results);
+        StackParameters finalParams = params;
+        finalParams.pruneLayers = false;
+        output = stack_slab(source, finalParams, pipelineConfig);
+    }
+    return output;
+}
+
+/// Creates a composite image while the layers are streamed from a source a second time. Only the
+/// depth map and one accumulator are held in memory, never the layers themselves.
+/// \param source The frames of the stack, in the same order as when the depth map was computed
+/// \param transforms The per frame transforms, frames with an empty transform are not part of the stack
+/// \param depthMap The smoothed depth map (CV_16U fixed point)
+/// \param blendLayers Whether to blend layers
+/// \return The composite image
+cv::Mat ImageProcessing::create_composite_image_streaming(FrameSource& source, const std::vector<cv::Mat>& transforms, const cv::Mat& depthMap, bool blendLayers){
+    //Map input frames to layer indices of the depth map
+    std::vector<int> layerOfFrame(transforms.size(), -1);
+    int layerCount = 0;
+    for (size_t i = 0; i < transforms.size(); i++) {
+        if (!transforms[i].empty()) {
+            layerOfFrame[i] = layerCount++;
+        }
+    }
+
+    const int fractionBits = depth_fraction_bits(layerCount);
+    const int fixedScale = 1 << fractionBits;
+
+    //Each pixel takes (scale - fraction) parts of its lower layer and fraction parts of its upper
+    //layer, the sum of at most 255 * 256 fits in 16 bits
+    cv::Mat accumulator = cv::Mat::zeros(depthMap.size(), CV_16UC3);
+
+    emit progress("Combining layers.", 0, layerCount);
+    int combined = 0;
+    int index;
+    cv::Mat frame;
+    while (source.next(index, frame)) {
+        if (index >= static_cast<int>(layerOfFrame.size()) || layerOfFrame[index] < 0 || frame.size() != depthMap.size()) {
+            continue;
+        }
+        int layer = layerOfFrame[index];
+
+        cv::Mat aligned = frame;
+        if (!is_identity(transforms[index])) {
+            cv::warpAffine(frame, aligned, transforms[index], depthMap.size(), cv::INTER_CUBIC, cv::BORDER_REPLICATE);
+        }
+
+        const Kernels& k = kernels();
+        cv::parallel_for_(cv::Range(0, depthMap.rows), [&](const cv::Range& range) {
+            for (int r = range.start; r < range.end; r++) {
+                k.accumulate_layer_row(depthMap.ptr<ushort>(r), aligned.ptr<uchar>(r), accumulator.ptr<ushort>(r), depthMap.cols, layer, layerCount, fractionBits, blendLayers);
+            }
+        });
+        emit progress("Combining layers.", ++combined, layerCount);
+    }
+
+    cv::Mat composite;
+    accumulator.convertTo(composite, CV_8UC3, 1.0 / fixedScale);
+    return composite;
+}
+
+/// Focus stacks a video or a numbered image sequence. The frames are read twice, once to align and
+/// score them and once to combine them, so the whole sweep is never held in memory.
+/// \param path The video file, or any image of a numbered sequence
+/// \param decimation Only every decimation:th frame is used
+/// \param params The stacking parameters
+void ImageProcessing::focus_stack_stream(const QString& path, int decimation, const StackParameters& params) {
+    auto openSource = [&]() -> std::unique_ptr<FrameSource> {
+        if (VideoSource::isVideo(path)) {
+            return std::unique_ptr<FrameSource>(new VideoSource(path, decimation));
+        }
+        QStringList sequence = ImageFileSource::sequenceFiles(path);
+        QStringList decimated;
+        for (int i = 0; i < sequence.size(); i += std::max(1, decimation)) {
+            decimated << sequence[i];
+        }
+        return std::unique_ptr<FrameSource>(new ImageFileSource(decimated));
+    };
+
+    //First pass, only the transforms and the depth map are kept
+    std::unique_ptr<FrameSource> source = openSource();
+    StackLayers layers = run_pipeline(*source, nullptr, params, true, pipelineConfig, false);
+    if (layers.layerCount == 0) {
+        emit focusStackingComplete(cv::Mat());
+        return;
+    }
+
+    cv::Mat depthMap = create_depth_map(layers.rawDepthMap, layers.baseImage, layers.layerCount, params);
+
+    //Second pass, the frames are warped and combined as they are read
+    source = openSource();
+    cv::Mat output = create_composite_image_streaming(*source, layers.transforms, depthMap, params.blendLayers);
+
+    emit focusStackingComplete(output);
+}
+
+/// Focus stacks a set of images
+/// \param files The image files to focus stack
+/// \param params The stacking parameters
+void ImageProcessing::focus_stack(const QStringList& files, const StackParameters& params) {
+    //Deep stacks are stacked in slabs to bound the memory use and the alignment drift
+    if (params.slabSize > 0 && files.size() > params.slabSize) {
+        cv::Mat output = stack_slabs(files, params);
+        emit focusStackingComplete(output);
+        return;
+    }
+
+    ImageFileSource source(files);
+
+    //Leave out duplicate and blurred frames before they are decoded at full resolution
+    QStringList pruneReport;
+    std::vector<int> redundant;
+    if (params.pruneLayers) {
+        redundant = find_redundant_frames(source, pruneReport);
+        for (int index : redundant) {
+            source.skip(index);
+        }
+    }
+
+    //Pick the memory mode, the threads and the depth resolution from the size of the stack and the machine
+    StackParameters runParams = params;
+    PipelineConfig runConfig = pipelineConfig;
+    ExecutionPlanner planner;
+    ExecutionPlan plan;
+    if (params.planExecution) {
+        plan = planner.plan(ExecutionPlanner::readShape(files, static_cast<int>(redundant.size())), params, MachineResources::detect());
+        runParams = plan.apply(params);
+        runConfig = plan.config;
+        std::cout << plan.describe().toStdString() << std::endl;
+    }
+    bool outOfCore = params.planExecution && plan.memoryMode == MemoryMode::OutOfCore;
+
+    //Log the measured time next to the prediction and calibrate the model with it
+    StageTimes actual;
+    auto reportPlan = [&]() {
+        if (!params.planExecution) {
+            return;
+        }
+        std::cout << QString("Predicted %1 s, took %2 s (pipeline %3 s, depth map %4 s, composite %5 s)")
+                         .arg(plan.predicted.total(), 0, 'f', 1)
+                         .arg(actual.total(), 0, 'f', 1)
+                         .arg(actual.pipeline, 0, 'f', 1)
+                         .arg(actual.depthMap, 0, 'f', 1)
+                         .arg(actual.composite, 0, 'f', 1)
+                         .toStdString() << std::endl;
+        planner.calibrate(plan, actual);
+    };
+
+    //Decode, align and compute the depth map. Single pass and out of core composites do not keep the layers.
+    bool singlePass = params.singlePass && !params.blendLayers;
+    auto start = std::chrono::steady_clock::now();
+    StackLayers layers = run_pipeline(source, nullptr, runParams, true, runConfig, !singlePass && !outOfCore);
+    if (layers.layerCount == 0) {
+        emit focusStackingComplete(cv::Mat());
+        return;
+    }
+    double pipelineSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    actual.pipeline = pipelineSeconds;
+
+    if (params.pruneLayers) {
+        for (int index : layers.unusedLayers) {
+            pruneReport << QString("Layer %1: no sharpest pixels").arg(index + 1);
+        }
+
+        //Every processed frame costs about the same to decode, align and score
+        int processed = files.size() - static_cast<int>(redundant.size());
+        double secondsSaved = processed > 0 ? pipelineSeconds / processed * redundant.size() : 0.0;
+        QString summary = QString("Pruned %1 of %2 layers, saved about %3 s and freed %4 MB.")
+                              .arg(redundant.size() + layers.unusedLayers.size())
+                              .arg(files.size())
+                              .arg(secondsSaved, 0, 'f', 1)
+                              .arg(layers.freedBytes / (1024.0 * 1024.0), 0, 'f', 0);
+        std::cout << summary.toStdString() << std::endl;
+        for (const QString& line : pruneReport) {
+            std::cout << "  " << line.toStdString() << std::endl;
+        }
+        emit report(summary, pruneReport);
+    }
+
+    //The single pass composite is already complete, the depth map is smoothed when the layers are combined again
+    if (singlePass) {
+        reportPlan();
+        emit stackStateAvailable(layers.transforms, layers.rawDepthMap, cv::Mat(), runParams);
+        emit focusStackingComplete(layers.composite);
+        return;
+    }
+
+    start = std::chrono::steady_clock::now();
+    cv::Mat depthMap = create_depth_map(layers.rawDepthMap, layers.baseImage, layers.layerCount, runParams);
+    actual.depthMap = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    //Create the composite image from the depth map, out of core the layers are decoded a second time
+    start = std::chrono::steady_clock::now();
+    cv::Mat output;
+    if (outOfCore) {
+        //The second pass has to leave out the same frames as the first, the depth map indexes the kept ones
+        ImageFileSource compositeSource(files);
+        for (int index : redundant) {
+            compositeSource.skip(index);
+        }
+        output = create_composite_image_streaming(compositeSource, layers.transforms, depthMap, runParams.blendLayers);
+    }
+    else {
+        output = composite_layers(layers, depthMap, runParams.blendLayers, runParams.tileSize);
+    }
+    actual.composite = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    reportPlan();
+
+    //Hand over the intermediate results so that they can be stored in a project
+    emit stackStateAvailable(layers.transforms, layers.rawDepthMap, depthMap, runParams);
 
     // Emit the final output image
     emit focusStackingComplete(output);
 }
+
+/// Recreates the composite from a stored alignment and depth map, skipping feature matching and scoring
+/// \param files The image files
+/// \param transforms The stored per layer transforms
+/// \param rawDepthMap The stored raw depth map
+/// \param depthMap The stored smoothed depth map, empty if the depth map should be smoothed again
+/// \param params The stacking parameters
+void ImageProcessing::recomposite(const QStringList& files, const std::vector<cv::Mat>& transforms, const cv::Mat& rawDepthMap, const cv::Mat& depthMap, const StackParameters& params) {
+    //Decode and warp with the stored transforms
+    ImageFileSource source(files);
+    StackLayers layers = run_pipeline(source, &transforms, params, false, pipelineConfig);
+    if (layers.images.empty()) {
+        emit focusStackingComplete(cv::Mat());
+        return;
+    }
+
+    //Only smooth again if the smoothing parameters have changed. Projects from older versions
+    //store the smoothed depth map as float layer indices.
+    cv::Mat smoothed = depthMap;
+    if (!smoothed.empty() && smoothed.type() != CV_16U) {
+        smoothed.convertTo(smoothed, CV_16U, 1 << depth_fraction_bits(layers.layerCount));
+    }
+    if (smoothed.empty()) {
+        smoothed = create_depth_map(rawDepthMap, layers.baseImage, layers.layerCount, params);
+    }
+
+    cv::Mat output = composite_layers(layers, smoothed, params.blendLayers);
+
+    emit stackStateAvailable(transforms, rawDepthMap, smoothed, params);
+    emit focusStackingComplete(output);
+}
+
+/// Returns how far beyond a region the layers influence its result. The blur and the Laplacian,
+/// the variance window, every smoothing pass and the depth map upsampling each reach a bit further.
+/// \param params The stacking parameters
+/// \return The halo in layer pixels
+int ImageProcessing::region_halo(const StackParameters& params) {
+    int depthScale = std::max(1, params.depthScale);
+    return 2 + params.laplaceKernelSize / 2 + params.smoothIterations * (params.smoothKernelSize / 2 + 1) + 3 * depthScale;
+}
+
+/// Decodes the layers and warps the part of them that covers an area with the stored transforms.
+/// The crops are kept, so that the area can be stacked again without touching the files.
+/// \param files The image files
+/// \param transforms The stored per layer transforms, empty for layers that were left out
+/// \param area The area that is needed in layer coordinates
+/// \param slack How much more than the area to load, so that larger kernels can be tried without loading again
+/// \return False if no layer could be loaded
+bool ImageProcessing::load_region(const QStringList& files, const std::vector<cv::Mat>& transforms, const cv::Rect& area, int slack) {
+    bool sameTransforms = regionCache.transforms.size() == transforms.size();
+    for (size_t i = 0; sameTransforms && i < transforms.size(); i++) {
+        sameTransforms = regionCache.transforms[i].empty() == transforms[i].empty()
+                         && (transforms[i].empty() || cv::norm(regionCache.transforms[i], transforms[i], cv::NORM_INF) == 0.0);
+    }
+    cv::Rect needed = area & cv::Rect(cv::Point(0, 0), regionCache.frameSize);
+    if (sameTransforms && regionCache.files == files && !regionCache.crops.empty() && (regionCache.area & needed) == needed) {
+        return true;
+    }
+
+    //Each layer only keeps its crop, the decoded frame is released right away
+    cv::Rect loadArea(std::max(0, area.x - slack), std::max(0, area.y - slack), 0, 0);
+    loadArea.width = area.br().x + slack - loadArea.x;
+    loadArea.height = area.br().y + slack - loadArea.y;
+    std::vector<cv::Mat> crops(files.size());
+    cv::Size frameSize;
+    std::mutex frameSizeMutex;
+    std::atomic<int> loaded{0};
+    emit progress("Loading region.", 0, static_cast<int>(files.size()));
+    cv::parallel_for_(cv::Range(0, static_cast<int>(files.size())), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; i++) {
+            if (static_cast<size_t>(i) >= transforms.size() || transforms[i].empty()) {
+                continue;
+            }
+            cv::Mat frame = cv::imread(files[i].toStdString());
+            if (frame.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                std::lock_guard<std::mutex> lock(frameSizeMutex);
+                frameSize = frame.size();
+            }
+
+            //Shift the transform so that the crop origin lands on the origin of the output
+            cv::Rect cropArea = loadArea & cv::Rect(cv::Point(0, 0), frame.size());
+            cv::Mat H;
+            transforms[i].convertTo(H, CV_64F);
+            H.at<double>(0, 2) -= cropArea.x;
+            H.at<double>(1, 2) -= cropArea.y;
+            cv::warpAffine(frame, crops[i], H, cropArea.size(), cv::INTER_CUBIC, cv::BORDER_REPLICATE);
+            emit progress("Loading region.", ++loaded, static_cast<int>(files.size()));
+        }
+    });
+
+    regionCache = RegionCache();
+    if (crops[0].empty()) {
+        return false;
+    }
+    regionCache.files = files;
+    for (const cv::Mat& transform : transforms) {
+        regionCache.transforms.push_back(transform.clone());
+    }
+    regionCache.frameSize = frameSize;
+    regionCache.area = loadArea & cv::Rect(cv::Point(0, 0), frameSize);
+    for (cv::Mat& crop : crops) {
+        if (!crop.empty() && crop.size() == regionCache.area.size()) {
+            regionCache.crops.push_back(crop);
+        }
+    }
+    return true;
+}
+
+/// Stacks a region of the layers with stored transforms. Only the region and the halo around it
+/// are scored, smoothed and composited, the layers are warped into crops of that area.
+/// \param files The image files
+/// \param transforms The stored per layer transforms
+/// \param region The region to stack, clipped to the layers on return
+/// \param params The stacking parameters
+/// \param keepRegion Whether to keep the aligned crops, with some slack, for the next call
+/// \return The composite of the region, empty if it could not be stacked
+cv::Mat ImageProcessing::stack_region(const QStringList& files, const std::vector<cv::Mat>& transforms, cv::Rect& region, const StackParameters& params, bool keepRegion) {
+    auto start = std::chrono::steady_clock::now();
+    if (files.isEmpty() || transforms.size() != static_cast<size_t>(files.size()) || transforms[0].empty() || region.area() <= 0) {
+        return cv::Mat();
+    }
+
+    //Start and end the area on the depth map grid, so that its depth pixels are the blocks of a full run
+    int depthScale = std::max(1, params.depthScale);
+    int halo = region_halo(params);
+    int left = std::max(0, region.x - halo) / depthScale * depthScale;
+    int top = std::max(0, region.y - halo) / depthScale * depthScale;
+    int right = (region.br().x + halo + depthScale - 1) / depthScale * depthScale;
+    int bottom = (region.br().y + halo + depthScale - 1) / depthScale * depthScale;
+    cv::Rect area(left, top, right - left, bottom - top);
+
+    if (!load_region(files, transforms, area, keepRegion ? 64 : 0)) {
+        return cv::Mat();
+    }
+    cv::Rect frameRect(cv::Point(0, 0), regionCache.frameSize);
+    region &= frameRect;
+    area &= frameRect;
+    if (region.empty()) {
+        return cv::Mat();
+    }
+
+    std::vector<cv::Mat> layers;
+    cv::Rect inCache = area - regionCache.area.tl();
+    for (const cv::Mat& crop : regionCache.crops) {
+        layers.push_back(crop(inCache));
+    }
+    int layerCount = static_cast<int>(layers.size());
+    if (!keepRegion) {
+        regionCache = RegionCache();
+    }
+
+    //Score the area like the pipeline does, the layer index is the position in the stack
+    cv::Size depthSize((area.width + depthScale - 1) / depthScale, (area.height + depthScale - 1) / depthScale);
+    int scoringKernelSize = depthScale > 1 ? std::max(3, (params.laplaceKernelSize / depthScale) | 1) : params.laplaceKernelSize;
+    cv::Mat sharpnessMax = cv::Mat::zeros(depthSize, CV_64F);
+    cv::Mat rawDepthMap = cv::Mat::zeros(depthSize, CV_16U);
+    ScoreWorkspace workspace;
+    for (int i = 0; i < layerCount; i++) {
+        cv::Mat scoringImage = layers[i];
+        if (scoringImage.size() != depthSize) {
+            reduce_to_depth_grid(scoringImage, workspace.scoring, depthScale);
+            scoringImage = workspace.scoring;
+        }
+        update_depth_map(compute_sharpness(scoringImage, scoringKernelSize, workspace), i, sharpnessMax, rawDepthMap);
+    }
+
+    cv::Mat depthMap = create_depth_map(rawDepthMap, layers[0], layerCount, params);
+    cv::Mat composite = create_composite_image_from_depth_map(layers, depthMap, params.blendLayers);
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "Stacked a " << region.width << "x" << region.height << " region of " << layerCount << " layers in " << elapsed.count() << " ms" << std::endl;
+    return composite(region - area.tl()).clone();
+}
+
+/// Stacks a region of the result again with the stored alignment. The aligned crops are kept,
+/// so that the region can be tried with other parameters without loading the layers again.
+/// \param files The image files
+/// \param transforms The stored per layer transforms
+/// \param region The region of the result to stack again
+/// \param params The stacking parameters
+void ImageProcessing::restack_region(const QStringList& files, const std::vector<cv::Mat>& transforms, const QRect& region, const StackParameters& params) {
+    cv::Rect roi(region.x(), region.y(), region.width(), region.height());
+    cv::Mat patch = stack_region(files, transforms, roi, params, true);
+    emit regionRestacked(patch, QRect(roi.x, roi.y, roi.width, roi.height));
+}
+
+/// Aligns the frames of a source without scoring them or keeping them
+/// \param source The frames of the stack, frame 0 is the base image
+/// \param params The stacking parameters
+/// \param frameSize Receives the size of the base image if given
+/// \return One transform per frame, empty for frames that could not be aligned
+std::vector<cv::Mat> ImageProcessing::align_frames(FrameSource& source, const StackParameters& params, cv::Size* frameSize) {
+    //Deferred warping without scoring leaves the frames unwarped
+    StackParameters alignParams = params;
+    alignParams.deferredWarp = true;
+    alignParams.singlePass = false;
+    StackLayers layers = run_pipeline(source, nullptr, alignParams, false, pipelineConfig, false);
+    if (frameSize != nullptr) {
+        *frameSize = layers.baseImage.size();
+    }
+    return layers.transforms;
+}
+
+/// Stacks a time-lapse series of focus stacks. Each stack starts from the transforms and the depth
+/// map of the stack before it: the transforms are refined by phase correlation instead of matching
+/// features, and only the parts of the depth map that changed are smoothed again. The depth map of
+/// one stack is smoothed and its composite written while the next stack is aligned and scored.
+/// \param stacks The image files of each stack, in capture order
+/// \param params The stacking parameters
+/// \param writeResult Called with the index and the composite of each stack, returns false if the
+/// composite could not be written. Called from a background thread, one stack at a time.
+/// \return The number of stacks that were stacked and written
+int ImageProcessing::stack_series(const std::vector<QStringList>& stacks, const StackParameters& params, const std::function<bool(int, const cv::Mat&)>& writeResult) {
+    //Every stack needs its layers for the composite that overlaps the next stack
+    StackParameters stackParams = params;
+    stackParams.singlePass = false;
+
+    SeriesPrior prior;
+    std::thread finisher;
+    std::atomic<int> written{0};
+    int frames = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t k = 0; k < stacks.size(); k++) {
+        std::cout << "Stacking series item " << k + 1 << "/" << stacks.size() << std::endl;
+        ImageFileSource source(stacks[k]);
+        bool usePrior = prior.transforms.size() == static_cast<size_t>(stacks[k].size());
+        std::shared_ptr<StackLayers> layers = std::make_shared<StackLayers>(run_pipeline(source, nullptr, stackParams, true, pipelineConfig, true, usePrior ? &prior.transforms : nullptr));
+        frames += stacks[k].size();
+
+        //The previous stack is still using the prior
+        if (finisher.joinable()) {
+            finisher.join();
+        }
+        if (layers->layerCount == 0) {
+            std::cerr << "Series item " << k + 1 << " could not be stacked" << std::endl;
+            prior = SeriesPrior();
+            continue;
+        }
+
+        //Depth values index the kept layers, they only mean the same if the same frames were kept
+        std::vector<int> keptFrames;
+        for (size_t i = 0; i < layers->transforms.size(); i++) {
+            if (!layers->transforms[i].empty()) {
+                keptFrames.push_back(static_cast<int>(i));
+            }
+        }
+
+        int fractionBits = depth_fraction_bits(layers->layerCount);
+        bool samePrior = prior.layerCount == layers->layerCount && prior.keptFrames == keptFrames && prior.params.smoothKernelSize == stackParams.smoothKernelSize && prior.params.smoothStrength == stackParams.smoothStrength
+                         && prior.params.smoothIterations == stackParams.smoothIterations && prior.params.depthScale == stackParams.depthScale;
+        SeriesPrior previous = samePrior ? prior : SeriesPrior();
+        prior.transforms = layers->transforms;
+        prior.rawDepthMap = layers->rawDepthMap;
+        prior.layerCount = layers->layerCount;
+        prior.keptFrames = keptFrames;
+        prior.params = stackParams;
+
+        //Smoothing updates the prior that the alignment of the next stack does not read
+        finisher = std::thread([this, k, layers, previous, fractionBits, &prior, &stackParams, &writeResult, &written]() {
+            cv::Mat depthMap = smooth_depth_map_with_prior(layers->rawDepthMap, previous, stackParams, fractionBits);
+            prior.smoothedDepthMap = depthMap;
+            if (depthMap.size() != layers->baseImage.size()) {
+                depthMap = upsample_depth_map(depthMap, layers->baseImage, stackParams.depthScale);
+            }
+            cv::Mat composite = composite_layers(*layers, depthMap, stackParams.blendLayers);
+            if (writeResult(static_cast<int>(k), composite)) {
+                written++;
+            }
+        });
+    }
+    if (finisher.joinable()) {
+        finisher.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Series of " << stacks.size() << " stacks, " << frames << " frames in " << seconds << " s, "
+              << (stacks.empty() ? 0.0 : seconds / stacks.size()) << " s per stack, "
+              << (seconds > 0.0 ? frames / seconds : 0.0) << " frames/s" << std::endl;
+    return written;
+}
+
+/// Stacks the same layers with several parameter sets. The layers are decoded and aligned once and
+/// the Laplacian of each layer is computed once per depth resolution, the sharpness for each Laplacian
+/// window is derived from it. The variants are then smoothed and composited in parallel.
+/// \param files The image files
+/// \param variants The parameter sets, only the scoring, depth resolution, smoothing and blending parameters may differ
+void ImageProcessing::parameter_sweep(const QStringList& files, const std::vector<StackParameters>& variants) {
+    if (variants.empty()) {
+        emit sweepComplete(cv::Mat(), std::vector<cv::Mat>());
+        return;
+    }
+
+    //Decode and align with the first variant, warped layers are needed by every variant
+    StackParameters alignParams = variants[0];
+    alignParams.deferredWarp = false;
+    alignParams.singlePass = false;
+    alignParams.pruneLayers = false;
+    ImageFileSource source(files);
+    StackLayers layers = run_pipeline(source, nullptr, alignParams, false, pipelineConfig);
+    if (layers.images.empty()) {
+        emit sweepComplete(cv::Mat(), std::vector<cv::Mat>());
+        return;
+    }
+
+    //One raw depth map per distinct Laplacian window and depth resolution, scaled as in the pipeline
+    cv::Size baseSize = layers.baseImage.size();
+    std::vector<std::pair<int, int>> depthKeys; // Window and depth scale
+    std::vector<int> depthScales;
+    for (const StackParameters& variant : variants) {
+        std::pair<int, int> key(variant.laplaceKernelSize, std::max(1, variant.depthScale));
+        if (std::find(depthKeys.begin(), depthKeys.end(), key) == depthKeys.end()) {
+            depthKeys.push_back(key);
+        }
+        if (std::find(depthScales.begin(), depthScales.end(), key.second) == depthScales.end()) {
+            depthScales.push_back(key.second);
+        }
+    }
+    std::vector<cv::Mat> sharpnessMax(depthKeys.size());
+    std::vector<cv::Mat> rawDepthMaps(depthKeys.size());
+    std::vector<ScoreWorkspace> workspaces(depthKeys.size());
+    for (size_t k = 0; k < depthKeys.size(); k++) {
+        int depthScale = depthKeys[k].second;
+        cv::Size depthSize((baseSize.width + depthScale - 1) / depthScale, (baseSize.height + depthScale - 1) / depthScale);
+        sharpnessMax[k] = cv::Mat::zeros(depthSize, CV_64F);
+        rawDepthMaps[k] = cv::Mat::zeros(depthSize, CV_16U);
+    }
+
+    //The Laplacian is computed once per layer and depth resolution and shared by the windows
+    ScoreWorkspace shared;
+    int layerCount = static_cast<int>(layers.images.size());
+    emit progress("Generating depth maps.", 0, layerCount);
+    for (int i = 0; i < layerCount; i++) {
+        for (int depthScale : depthScales) {
+            cv::Mat scoringImage = layers.images[i];
+            if (depthScale > 1) {
+                reduce_to_depth_grid(scoringImage, shared.scoring, depthScale);
+                scoringImage = shared.scoring;
+            }
+            cv::cvtColor(scoringImage, shared.gray, cv::COLOR_BGR2GRAY);
+            cv::GaussianBlur(shared.gray, shared.gaussian, cv::Size(3,3), 0);
+            cv::Laplacian(shared.gaussian, shared.laplacian, CV_64F, 1);
+
+            cv::parallel_for_(cv::Range(0, static_cast<int>(depthKeys.size())), [&](const cv::Range& range) {
+                for (int k = range.start; k < range.end; k++) {
+                    if (depthKeys[k].second != depthScale) {
+                        continue;
+                    }
+                    int window = depthScale > 1 ? std::max(3, (depthKeys[k].first / depthScale) | 1) : depthKeys[k].first;
+                    compute_local_variance(shared.laplacian, workspaces[k].sharpness, window, workspaces[k]);
+                    update_depth_map(workspaces[k].sharpness, i, sharpnessMax[k], rawDepthMaps[k]);
+                }
+            });
+        }
+        emit progress("Generating depth maps.", i + 1, layerCount);
+    }
+
+    //Each variant smooths its depth map and composites on its own
+    std::vector<cv::Mat> results(variants.size());
+    std::atomic<int> finished{0};
+    int variantCount = static_cast<int>(variants.size());
+    emit progress("Creating variants.", 0, variantCount);
+    cv::parallel_for_(cv::Range(0, variantCount), [&](const cv::Range& range) {
+        for (int v = range.start; v < range.end; v++) {
+            std::pair<int, int> key(variants[v].laplaceKernelSize, std::max(1, variants[v].depthScale));
+            size_t k = std::find(depthKeys.begin(), depthKeys.end(), key) - depthKeys.begin();
+            cv::Mat depthMap = create_depth_map(rawDepthMaps[k], layers.baseImage, layerCount, variants[v]);
+            results[v] = composite_layers(layers, depthMap, variants[v].blendLayers);
+            emit progress("Creating variants.", ++finished, variantCount);
+        }
+    });
+
+    emit sweepComplete(create_contact_sheet(results, variants), results);
+}
+
+/// Lays out downscaled variants of a parameter sweep in a grid, each labeled with its parameters
+/// \param images The variant images
+/// \param variants The parameters of each variant
+/// \return The contact sheet
+cv::Mat ImageProcessing::create_contact_sheet(const std::vector<cv::Mat>& images, const std::vector<StackParameters>& variants) {
+    const int tileWidth = 480;
+    const int labelHeight = 28;
+    if (images.empty() || images[0].empty()) {
+        return cv::Mat();
+    }
+
+    int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(images.size()))));
+    int rows = (static_cast<int>(images.size()) + columns - 1) / columns;
+    int tileHeight = std::max(1, cvRound(static_cast<double>(tileWidth) * images[0].rows / images[0].cols));
+    cv::Mat sheet(rows * (tileHeight + labelHeight), columns * tileWidth, images[0].type(), cv::Scalar::all(0));
+
+    for (size_t i = 0; i < images.size(); i++) {
+        int x = static_cast<int>(i % columns) * tileWidth;
+        int y = static_cast<int>(i / columns) * (tileHeight + labelHeight);
+        cv::Mat tile = sheet(cv::Rect(x, y, tileWidth, tileHeight));
+        cv::resize(images[i], tile, tile.size(), 0, 0, cv::INTER_AREA);
+
+        const StackParameters& p = variants[i];
+        std::string label = "L" + std::to_string(p.laplaceKernelSize) + " K" + std::to_string(p.smoothKernelSize)
+                            + " S" + std::to_string(p.smoothStrength) + " I" + std::to_string(p.smoothIterations);
+        cv::putText(sheet, label, cv::Point(x + 6, y + tileHeight + labelHeight - 8), cv::FONT_HERSHEY_SIMPLEX, 0.6, cv::Scalar::all(255), 1, cv::LINE_AA);
+    }
+    return sheet;
+}
+
+/// Starts a stack that frames are added to one at a time
+/// \param params The stacking parameters
+void ImageProcessing::incremental_begin(const StackParameters& params) {
+    incremental = IncrementalStack();
+    incremental.params = params;
+    incremental.detector = cv::SIFT::create( );
+}
+
+/// Aligns a new frame to the base frame, scores it and folds it into the running depth map.
+/// The first frame becomes the base frame.
+/// \param file The image file of the new frame
+void ImageProcessing::incremental_add(const QString& file) {
+    IncrementalStack& stack = incremental;
+    int frameIndex = static_cast<int>(stack.transforms.size());
+    stack.transforms.push_back(cv::Mat());
+
+    cv::Mat frame = cv::imread(file.toStdString());
+    if (frame.empty()) {
+        std::cerr << "Could not decode " << file.toStdString() << std::endl;
+        return;
+    }
+
+    cv::Mat aligned;
+    if (stack.images.empty()) {
+        if (!prepare_alignment_base(frame, stack.alignmentBase, stack.params.translationFirst)) {
+            std::cerr << "No features found in the base image." << std::endl;
+        }
+
+        int depthScale = std::max(1, stack.params.depthScale);
+        stack.depthSize = cv::Size((frame.cols + depthScale - 1) / depthScale, (frame.rows + depthScale - 1) / depthScale);
+        stack.scoringKernelSize = depthScale > 1 ? std::max(3, (stack.params.laplaceKernelSize / depthScale) | 1) : stack.params.laplaceKernelSize;
+        stack.sharpnessMax = cv::Mat::zeros(stack.depthSize, CV_64F);
+        stack.rawDepthMap = cv::Mat::zeros(stack.depthSize, CV_16U);
+        stack.preview = frame.clone();
+
+        stack.transforms[frameIndex] = cv::Mat::eye(2, 3, CV_64F);
+        aligned = frame;
+    }
+    else {
+        if (frame.size() != stack.alignmentBase.size) {
+            std::cerr << "Skipping " << file.toStdString() << ", it differs in size from the base image" << std::endl;
+            return;
+        }
+
+        std::cout << "Aligning image " << frameIndex << std::endl;
+        cv::Mat H = estimate_alignment(frame, stack.alignmentBase, stack.detector, stack.alignWorkspace, stack.params.translationFirst);
+        if (H.empty()) {
+            return;
+        }
+        warpAffine(frame, aligned, H, frame.size(), cv::INTER_CUBIC, cv::BORDER_REPLICATE);
+        stack.transforms[frameIndex] = H;
+    }
+
+    int layer = static_cast<int>(stack.images.size());
+    stack.images.push_back(aligned);
+
+    std::cout << "Processing layer " << layer << std::endl;
+    int depthScale = std::max(1, stack.params.depthScale);
+    cv::Mat scoringImage = aligned;
+    if (stack.depthSize != aligned.size()) {
+        reduce_to_depth_grid(aligned, stack.scoreWorkspace.scoring, depthScale);
+        scoringImage = stack.scoreWorkspace.scoring;
+    }
+    update_depth_map(compute_sharpness(scoringImage, stack.scoringKernelSize, stack.scoreWorkspace), layer, stack.sharpnessMax, stack.rawDepthMap);
+
+    //The new layer has the highest index, so the pixels it won are exactly the ones that now point to it.
+    //Each depth pixel covers a block of the layer, the blocks at the right and bottom edge are cut off.
+    cv::parallel_for_(cv::Range(0, stack.rawDepthMap.rows), [&](const cv::Range& range) {
+        copy_winning_pixels(aligned, stack.rawDepthMap, static_cast<ushort>(layer), depthScale, range.start, range.end, stack.preview);
+    });
+
+    emit renderImage(stack.preview);
+    emit progress("Adding layers.", layer + 1, layer + 1);
+}
+
+/// Smooths the running depth map and creates the final composite of the incremental stack
+void ImageProcessing::incremental_finish() {
+    IncrementalStack& stack = incremental;
+    if (stack.images.empty()) {
+        emit focusStackingComplete(cv::Mat());
+        return;
+    }
+
+    int layerCount = static_cast<int>(stack.images.size());
+    cv::Mat depthMap = create_depth_map(stack.rawDepthMap, stack.images[0], layerCount, stack.params);
+    cv::Mat output = create_composite_image_from_depth_map(stack.images, depthMap, stack.params.blendLayers);
+
+    emit stackStateAvailable(stack.transforms, stack.rawDepthMap, depthMap, stack.params);
+    emit focusStackingComplete(output);
+
+    incremental = IncrementalStack();
+}
@@ -2,33 +2,217 @@
 #define IMAGEPROCESSING_H
 
 #include <QObject>
+#include <QStringList>
+#include <QRect>
+#include <QMetaType>
 #include <opencv2/core/core.hpp>
 #include <opencv2/opencv.hpp>
 #include <opencv2/features2d/features2d.hpp>
 #include <vector>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <pipeline.h>
+#include <framesource.h>
 
 using namespace cv;
 using namespace std;
 
+/// Features of the base image that every other layer is aligned to
+struct AlignmentBase {
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+    cv::Size size;
+    cv::Mat image;                                   // The base image, features are detected on first use
+    std::shared_ptr<std::once_flag> featuresDetected = std::make_shared<std::once_flag>();
+
+    //Translation only alignment by phase correlation of downscaled gray images
+    double phaseScale = 1.0;                         // Full resolution pixels per phase image pixel
+    cv::Mat phaseGray;                               // Downscaled gray base image (CV_32F)
+    cv::Mat phaseWindow;                             // Hanning window of the whole phase image
+    cv::Mat quadrantWindow;                          // Hanning window of a quadrant of the phase image
+};
+
+/// Scratch buffers of one worker thread that are reused from layer to layer. OpenCV functions only
+/// allocate an output buffer when it does not already have the right size and type.
+struct Workspace {
+    size_t allocations = 0; // Buffers that had to be allocated or reallocated
+
+    /// Counts the buffers whose storage has changed since the last call
+    void count_allocations(std::initializer_list<const cv::Mat*> buffers) {
+        lastData.resize(buffers.size(), nullptr);
+        size_t i = 0;
+        for (const cv::Mat* buffer : buffers) {
+            if (buffer->data != lastData[i]) {
+                allocations++;
+                lastData[i] = buffer->data;
+            }
+            i++;
+        }
+    }
+
+private:
+    std::vector<const uchar*> lastData;
+};
+
+/// Buffers of the alignment of one layer
+struct AlignWorkspace : Workspace {
+    cv::Mat gray;
+    cv::Mat descriptors;
+    std::vector<cv::KeyPoint> keypoints;
+    std::vector<std::vector<cv::DMatch>> knnMatches;
+    std::vector<cv::Point2f> pointsRef, pointsCur;
+    cv::Mat phaseSmall, phaseGray, phaseWarped, quadrant;
+
+    void track() { count_allocations({&gray, &descriptors, &phaseSmall, &phaseGray, &phaseWarped, &quadrant}); }
+};
+
+/// Buffers of the sharpness estimation of one layer
+struct ScoreWorkspace : Workspace {
+    cv::Mat scoring, gray, gaussian, laplacian, laplacianSquared, mean, meanSquare, sharpness;
+
+    void track() { count_allocations({&scoring, &gray, &gaussian, &laplacian, &laplacianSquared, &mean, &meanSquare, &sharpness}); }
+};
+
+/// Parameters of a stacking run
+struct StackParameters {
+    int laplaceKernelSize = 3;
+    int smoothKernelSize = 17;
+    int smoothStrength = 100;
+    int smoothIterations = 5;
+    bool blendLayers = true;
+    int depthScale = 1; // Depth is estimated at 1/depthScale of the layer resolution (1, 2, 4 or 8)
+    bool pruneLayers = false;
+    int slabSize = 0;    // Frames per slab in hierarchical stacking, 0 stacks all frames at once
+    int slabOverlap = 2; // Frames shared by neighbouring slabs
+    int slabWorkers = 0; // Slabs stacked at the same time, 0 picks a count from the number of cores
+    bool deferredWarp = false; // Keep the original layers and warp them tile by tile while compositing
+    bool singlePass = false;   // Without blending, build the composite while the layers are scored and keep no layers
+    bool translationFirst = false; // Try a shift found by phase correlation before matching features
+    bool planExecution = false;    // Let the execution planner pick the memory mode, threads and depth resolution
+    int tileSize = 256;            // Tile edge of the deferred composite
+};
+Q_DECLARE_METATYPE(StackParameters)
+
+/// Output of the decode, align and score pipeline
+struct StackLayers {
+    std::vector<cv::Mat> images;     // Aligned layers in input order, layers that could not be aligned are left out
+    std::vector<cv::Mat> layerTransforms; // Transform of each layer in images when warping was deferred, images are then unwarped
+    std::vector<cv::Mat> transforms; // One transform per input frame, empty if the frame was left out
+    cv::Mat rawDepthMap;             // Index into images of the sharpest layer (CV_16U), empty if scoring was skipped
+    cv::Mat baseImage;               // The layer every other layer is aligned to
+    cv::Mat composite;               // Nearest layer composite of the unsmoothed depth map, only built in single pass mode
+    int layerCount = 0;              // Number of layers the depth map indexes, also when the layers are not kept
+    std::vector<int> unusedLayers;   // Input frames dropped because they were not the sharpest anywhere
+    size_t freedBytes = 0;
+};
+
+/// Running state of a stack that grows one frame at a time, e.g. during tethered capture
+struct IncrementalStack {
+    StackParameters params;
+    AlignmentBase alignmentBase;
+    cv::Ptr<SIFT> detector;
+    AlignWorkspace alignWorkspace;
+    ScoreWorkspace scoreWorkspace;
+    cv::Size depthSize;
+    int scoringKernelSize = 3;
+    cv::Mat sharpnessMax;            // Highest sharpness so far (CV_64F, depth resolution)
+    cv::Mat rawDepthMap;             // Index into images of the sharpest layer so far (CV_16U)
+    cv::Mat preview;                 // Nearest layer composite of the layers so far
+    std::vector<cv::Mat> images;     // Aligned layers in arrival order
+    std::vector<cv::Mat> transforms; // One transform per added frame, empty if the frame was left out
+};
+
+/// Aligned crops of the layers around a region of the result, kept so that the region can be
+/// stacked again with other parameters without decoding and warping the layers again
+struct RegionCache {
+    QStringList files;
+    std::vector<cv::Mat> transforms; // The transforms the crops were warped with
+    cv::Size frameSize;              // The size of the layers
+    cv::Rect area;                   // The cropped area in layer coordinates
+    std::vector<cv::Mat> crops;      // One aligned crop per layer that could be aligned
+};
+
+/// State carried from one stack of a time-lapse series to the next, neighbouring stacks
+/// are usually shot from the same position at the same focus steps
+struct SeriesPrior {
+    std::vector<cv::Mat> transforms; // One transform per frame of the previous stack
+    cv::Mat rawDepthMap;             // Raw depth map of the previous stack
+    cv::Mat smoothedDepthMap;        // Its smoothed depth map, before upsampling
+    int layerCount = 0;
+    std::vector<int> keptFrames;     // The input frame of each layer the depth map indexes
+    StackParameters params;          // The parameters the depth map was smoothed with
+};
+
 class ImageProcessing : public QObject
 {
     Q_OBJECT
+    friend class KernelBenchmark; // Times and checks the private processing steps
+
 public:
     explicit ImageProcessing(QObject *parent = nullptr);
+    void set_pipeline_config(const PipelineConfig& config);
+    cv::Mat stack_frames(FrameSource& source, const StackParameters& params, std::vector<cv::Mat>* transforms = nullptr);
+    std::vector<cv::Mat> align_frames(FrameSource& source, const StackParameters& params, cv::Size* frameSize = nullptr);
+    cv::Mat stack_region(const QStringList& files, const std::vector<cv::Mat>& transforms, cv::Rect& region, const StackParameters& params, bool keepRegion);
+    int stack_series(const std::vector<QStringList>& stacks, const StackParameters& params, const std::function<bool(int, const cv::Mat&)>& writeResult);
 
 private:
-    std::vector<cv::Mat> align_images(const std::vector<cv::Mat>& images);
-    cv::Mat compute_depth_map(const std::vector<cv::Mat>& images, int laplaceKernelSize, int smoothKernelSize, int smoothStrength, int smoothIterations);
+    PipelineConfig pipelineConfig;
+    IncrementalStack incremental;
+    RegionCache regionCache;
+
+    bool prepare_alignment_base(const cv::Mat& base, AlignmentBase& alignmentBase, bool translationFirst);
+    bool detect_base_features(AlignmentBase& alignmentBase);
+    cv::Mat estimate_translation(const cv::Mat& image, const AlignmentBase& alignmentBase, AlignWorkspace& workspace, const cv::Mat& prior = cv::Mat());
+    cv::Mat estimate_transform(const cv::Mat& image, AlignmentBase& alignmentBase, const cv::Ptr<SIFT>& detector, AlignWorkspace& workspace);
+    cv::Mat estimate_alignment(const cv::Mat& image, AlignmentBase& alignmentBase, const cv::Ptr<SIFT>& detector, AlignWorkspace& workspace, bool translationFirst);
+    const cv::Mat& compute_sharpness(const cv::Mat& image, int laplaceKernelSize, ScoreWorkspace& workspace);
+    void update_depth_map(const cv::Mat& sharpness, int layer, cv::Mat& sharpnessMax, cv::Mat& depthMap);
+    static bool is_identity(const cv::Mat& transform);
+    static void copy_winning_pixels(const cv::Mat& image, const cv::Mat& depthMap, ushort layer, int depthScale, int top, int bottom, cv::Mat& composite);
+    std::vector<int> find_redundant_frames(FrameSource& source, QStringList& reasons);
+    StackLayers run_pipeline(FrameSource& source, const std::vector<cv::Mat>* storedTransforms, const StackParameters& params, bool score, const PipelineConfig& config, bool keepLayers = true, const std::vector<cv::Mat>* priorTransforms = nullptr);
+    cv::Mat stack_slab(FrameSource& source, const StackParameters& params, const PipelineConfig& config);
+    std::vector<cv::Mat> stack_slab_level(int count, const StackParameters& params, const std::function<std::unique_ptr<FrameSource>(int, int)>& makeSource);
+    cv::Mat stack_slabs(const QStringList& files, const StackParameters& params);
+    static int depth_fraction_bits(int layerCount);
+    static void reduce_to_depth_grid(const cv::Mat& image, cv::Mat& reduced, int depthScale);
+    cv::Mat smooth_depth_map(const cv::Mat& rawDepthMap, int smoothKernelSize, int smoothStrength, int smoothIterations, int depthScale, int fractionBits);
+    void smoothing_pass(const cv::Mat& depthMap, cv::Mat& smoothed, int smoothKernelSize, int smoothStrength, int depthScale, int fractionBits);
+    cv::Mat smooth_depth_map_with_prior(const cv::Mat& rawDepthMap, const SeriesPrior& prior, const StackParameters& params, int fractionBits);
+    cv::Mat upsample_depth_map(const cv::Mat& depthMap, const cv::Mat& guideImage, int depthScale);
+    cv::Mat create_depth_map(const cv::Mat& rawDepthMap, const cv::Mat& baseImage, int layerCount, const StackParameters& params);
     cv::Mat create_composite_image_from_depth_map(const std::vector<cv::Mat>& images, const cv::Mat& depthMap, bool blendLayers);
-    void compute_local_variance(const cv::Mat& input, cv::Mat& output, int windowSize);
+    cv::Mat create_composite_image_deferred(const std::vector<cv::Mat>& images, const std::vector<cv::Mat>& transforms, const cv::Mat& depthMap, bool blendLayers, int tileSize = 256);
+    cv::Mat composite_layers(const StackLayers& layers, const cv::Mat& depthMap, bool blendLayers, int tileSize = 256);
+    cv::Mat create_composite_image_streaming(FrameSource& source, const std::vector<cv::Mat>& transforms, const cv::Mat& depthMap, bool blendLayers);
+    void compute_local_variance(const cv::Mat& input, cv::Mat& output, int windowSize, ScoreWorkspace& workspace);
+    static int region_halo(const StackParameters& params);
+    bool load_region(const QStringList& files, const std::vector<cv::Mat>& transforms, const cv::Rect& area, int slack);
+    static cv::Mat create_contact_sheet(const std::vector<cv::Mat>& images, const std::vector<StackParameters>& variants);
 
 public slots:
-    void focus_stack(const std::vector<cv::Mat>& unalignedImages, int laplaceKernelSize, int smoothKernelSize, int smoothStrength, int smoothIterations, bool blendLayers);
+    void focus_stack(const QStringList& files, const StackParameters& params);
+    void focus_stack_stream(const QString& path, int decimation, const StackParameters& params);
+    void recomposite(const QStringList& files, const std::vector<cv::Mat>& transforms, const cv::Mat& rawDepthMap, const cv::Mat& depthMap, const StackParameters& params);
+    void parameter_sweep(const QStringList& files, const std::vector<StackParameters>& variants);
+    void restack_region(const QStringList& files, const std::vector<cv::Mat>& transforms, const QRect& region, const StackParameters& params);
+    void incremental_begin(const StackParameters& params);
+    void incremental_add(const QString& file);
+    void incremental_finish();
 
 signals:
     void focusStackingComplete(cv::Mat result);
+    void stackStateAvailable(std::vector<cv::Mat> transforms, cv::Mat rawDepthMap, cv::Mat depthMap, StackParameters params);
     void renderImage(cv::Mat image, bool grayscale = false);
     void progress(QString label, int value, int max);
+    void report(QString summary, QStringList details);
+    void sweepComplete(cv::Mat contactSheet, std::vector<cv::Mat> variants);
+    void regionRestacked(cv::Mat patch, QRect region);
 };
 
 #endif // IMAGEPROCESSING_H
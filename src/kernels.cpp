@@ -0,0 +1,53 @@
+/****************************************************************************
+** File Name:   kernels.cpp
+**
+** Description:
+**     Picks the processing kernels for the instruction set of the CPU the
+**     program runs on.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "kernels.h"
+#include <opencv2/core/utility.hpp>
+
+namespace kernels_isa {
+namespace baseline { extern const Kernels table; }
+#ifdef FOCUSPOCUS_X86_KERNELS
+namespace sse4 { extern const Kernels table; }
+namespace avx2 { extern const Kernels table; }
+namespace avx512 { extern const Kernels table; }
+#endif
+}
+
+/// Returns every kernel table this CPU can run, from the baseline to the fastest
+/// \return The kernel tables
+std::vector<const Kernels*> available_kernels() {
+    std::vector<const Kernels*> tables = {&kernels_isa::baseline::table};
+#ifdef FOCUSPOCUS_X86_KERNELS
+    if (cv::checkHardwareSupport(CV_CPU_SSE4_1)) {
+        tables.push_back(&kernels_isa::sse4::table);
+    }
+    if (cv::checkHardwareSupport(CV_CPU_AVX2)) {
+        tables.push_back(&kernels_isa::avx2::table);
+    }
+    if (cv::checkHardwareSupport(CV_CPU_AVX_512F) && cv::checkHardwareSupport(CV_CPU_AVX_512BW)) {
+        tables.push_back(&kernels_isa::avx512::table);
+    }
+#endif
+    return tables;
+}
+
+/// Returns the kernels for the instruction set of this CPU, the choice is made on the first call
+/// \return The kernel table
+const Kernels& kernels() {
+    static const Kernels& selected = *available_kernels().back();
+    return selected;
+}
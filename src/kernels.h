@@ -0,0 +1,25 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cstdint>
+#include <vector>
+
+/// The per pixel loops of depth estimation and compositing. Every kernel is compiled once per
+/// instruction set and the fastest one the CPU supports is picked at runtime.
+struct Kernels {
+    const char* name;
+
+    // Folds one row of layer sharpness into the running maximum and its layer index
+    void (*update_depth_row)(const double* sharpness, double* sharpnessMax, uint16_t* depth, int cols, uint16_t layer);
+
+    // Adds one row of a 3 channel layer to a fixed point composite accumulator
+    void (*accumulate_layer_row)(const uint16_t* depth, const uint8_t* pixels, uint16_t* accumulator, int cols, int layer, int layerCount, int fractionBits, bool blendLayers);
+};
+
+// Returns the kernels for the instruction set of this CPU
+const Kernels& kernels();
+
+// Returns every kernel table this CPU can run, the baseline reference first
+std::vector<const Kernels*> available_kernels();
+
+#endif // KERNELS_H
@@ -0,0 +1,19 @@
+/****************************************************************************
+** File Name:   kernels_avx2.cpp
+**
+** Description:
+**     The processing kernels compiled for AVX2.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#define KERNEL_NAMESPACE avx2
+#define KERNEL_NAME "AVX2"
+#include "kernels_impl.h"
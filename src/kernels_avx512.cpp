@@ -0,0 +1,19 @@
+/****************************************************************************
+** File Name:   kernels_avx512.cpp
+**
+** Description:
+**     The processing kernels compiled for AVX-512.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#define KERNEL_NAMESPACE avx512
+#define KERNEL_NAME "AVX-512"
+#include "kernels_impl.h"
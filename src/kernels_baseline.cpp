@@ -0,0 +1,19 @@
+/****************************************************************************
+** File Name:   kernels_baseline.cpp
+**
+** Description:
+**     The processing kernels compiled for the baseline instruction set of the build.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#define KERNEL_NAMESPACE baseline
+#define KERNEL_NAME "Baseline"
+#include "kernels_impl.h"
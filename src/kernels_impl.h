@@ -0,0 +1,75 @@
+// Kernel bodies shared by all instruction sets. Each kernels_<isa>.cpp defines KERNEL_NAMESPACE and
+// includes this file, the compiler flags of that file decide which instructions the loops use.
+// The loops are written without branches on the pixel data so that they vectorize. No standard
+// library templates are used here: their instances are shared between files, so the linker could
+// keep the copy compiled with AVX2 or AVX-512 for the baseline kernels too.
+
+#ifndef KERNEL_NAMESPACE
+#error "KERNEL_NAMESPACE must be defined before including kernels_impl.h"
+#endif
+
+#include "kernels.h"
+
+namespace kernels_isa {
+namespace KERNEL_NAMESPACE {
+
+/// Folds one row of layer sharpness into the running maximum. Layers may arrive out of order,
+/// ties go to the higher layer as if the layers were processed in order.
+/// \param sharpness The sharpness of the layer
+/// \param sharpnessMax The highest sharpness so far
+/// \param depth The index of the sharpest layer so far
+/// \param cols The number of pixels in the row
+/// \param layer The index of the layer
+static void update_depth_row(const double* sharpness, double* sharpnessMax, uint16_t* depth, int cols, uint16_t layer) {
+    for (int c = 0; c < cols; c++) {
+        bool wins = sharpness[c] > sharpnessMax[c] || (sharpness[c] == sharpnessMax[c] && layer > depth[c]);
+        sharpnessMax[c] = wins ? sharpness[c] : sharpnessMax[c];
+        depth[c] = wins ? layer : depth[c];
+    }
+}
+
+/// Adds one row of a 3 channel layer to a fixed point accumulator. When blending, a pixel takes
+/// (scale - fraction) parts of its lower layer and fraction parts of its upper layer, otherwise
+/// all of the nearest layer.
+/// \param depth The smoothed depth map row (fixed point)
+/// \param pixels The layer row
+/// \param accumulator The accumulator row
+/// \param cols The number of pixels in the row
+/// \param layer The index of the layer
+/// \param layerCount The number of layers
+/// \param fractionBits The fraction bits of the depth map
+/// \param blendLayers Whether to blend neighbouring layers
+static void accumulate_layer_row(const uint16_t* depth, const uint8_t* pixels, uint16_t* accumulator, int cols, int layer, int layerCount, int fractionBits, bool blendLayers) {
+    const int scale = 1 << fractionBits;
+    const int fractionMask = scale - 1;
+
+    if (blendLayers) {
+        for (int c = 0; c < cols; c++) {
+            int lower = depth[c] >> fractionBits;
+            int fraction = depth[c] & fractionMask;
+            int weight = (layer == lower) ? scale - fraction : ((layer == lower + 1) ? fraction : 0);
+            for (int i = 0; i < 3; i++) {
+                accumulator[3 * c + i] = static_cast<uint16_t>(accumulator[3 * c + i] + weight * pixels[3 * c + i]);
+            }
+        }
+    }
+    else {
+        for (int c = 0; c < cols; c++) {
+            int rounded = (depth[c] + scale / 2) >> fractionBits;
+            int nearest = rounded < layerCount - 1 ? rounded : layerCount - 1;
+            int weight = (layer == nearest) ? scale : 0;
+            for (int i = 0; i < 3; i++) {
+                accumulator[3 * c + i] = static_cast<uint16_t>(accumulator[3 * c + i] + weight * pixels[3 * c + i]);
+            }
+        }
+    }
+}
+
+extern const Kernels table = {
+    KERNEL_NAME,
+    update_depth_row,
+    accumulate_layer_row
+};
+
+} // namespace KERNEL_NAMESPACE
+} // namespace kernels_isa
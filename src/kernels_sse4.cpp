@@ -0,0 +1,19 @@
+/****************************************************************************
+** File Name:   kernels_sse4.cpp
+**
+** Description:
+**     The processing kernels compiled for SSE4.1.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#define KERNEL_NAMESPACE sse4
+#define KERNEL_NAME "SSE4.1"
+#include "kernels_impl.h"
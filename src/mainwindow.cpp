@@ -55,20 +55,66 @@ MainWindow::MainWindow(QWidget *parent)
     ui->ResultImage->setRenderHints(QPainter::Antialiasing | QPainter::SmoothPixmapTransform);
     ui->RenderImage->setRenderHints(QPainter::Antialiasing | QPainter::SmoothPixmapTransform);
 
+    //Depth can be estimated at a reduced resolution and upsampled to the layer resolution
+    ui->DepthResolution->addItem("Full", 1);
+    ui->DepthResolution->addItem("1/2", 2);
+    ui->DepthResolution->addItem("1/4", 4);
+    ui->DepthResolution->addItem("1/8", 8);
+
     //register qmetatypes
     qRegisterMetaType<std::vector<cv::Mat>>("std::vector<cv::Mat>");
+    qRegisterMetaType<StackParameters>("StackParameters");
+    qRegisterMetaType<std::vector<StackParameters>>("std::vector<StackParameters>");
 
     imageProcessor = new ImageProcessing();
     connect(this, &MainWindow::focusStackImages, imageProcessor, &ImageProcessing::focus_stack);
     connect(imageProcessor, &ImageProcessing::focusStackingComplete, this, &MainWindow::focusStackingComplete);
     connect(imageProcessor, &ImageProcessing::renderImage, this, &MainWindow::renderImage);
     connect(imageProcessor, &ImageProcessing::progress, this, &MainWindow::progress);
+    connect(imageProcessor, &ImageProcessing::stackStateAvailable, this, &MainWindow::stackStateAvailable);
+    connect(imageProcessor, &ImageProcessing::report, this, &MainWindow::showReport);
+    connect(this, &MainWindow::recompositeImages, imageProcessor, &ImageProcessing::recomposite);
+    connect(this, &MainWindow::focusStackStream, imageProcessor, &ImageProcessing::focus_stack_stream);
+    connect(this, &MainWindow::incrementalBegin, imageProcessor, &ImageProcessing::incremental_begin);
+    connect(this, &MainWindow::incrementalAdd, imageProcessor, &ImageProcessing::incremental_add);
+    connect(this, &MainWindow::incrementalFinish, imageProcessor, &ImageProcessing::incremental_finish);
+    connect(this, &MainWindow::parameterSweep, imageProcessor, &ImageProcessing::parameter_sweep);
+    connect(imageProcessor, &ImageProcessing::sweepComplete, this, &MainWindow::sweepComplete);
+    connect(this, &MainWindow::restackRegion, imageProcessor, &ImageProcessing::restack_region);
+    connect(imageProcessor, &ImageProcessing::regionRestacked, this, &MainWindow::regionRestacked);
+
+    //A rectangle drawn on the result is stacked again with the current parameters
+    ui->ResultImage->setDragMode(QGraphicsView::RubberBandDrag);
+    connect(ui->ResultImage, &QGraphicsView::rubberBandChanged, this, &MainWindow::resultSelectionChanged);
+
+    //Single pass only applies when layers are not blended
+    connect(ui->BlendLayers, &QCheckBox::toggled, ui->SinglePass, [=](bool checked) {
+        ui->SinglePass->setEnabled(!checked);
+    });
+    ui->SinglePass->setEnabled(!ui->BlendLayers->isChecked());
+
+    //Scan a watched folder shortly after it changes, a camera may still be writing the new file
+    folderWatcher = new QFileSystemWatcher(this);
+    watchTimer = new QTimer(this);
+    watchTimer->setSingleShot(true);
+    watchTimer->setInterval(500);
+    connect(folderWatcher, &QFileSystemWatcher::directoryChanged, watchTimer, QOverload<>::of(&QTimer::start));
+    connect(watchTimer, &QTimer::timeout, this, &MainWindow::scanWatchedFolder);
 
     //Move imageProcessor to another thread to prevent UI from freezing
     QThread *thread = new QThread();
     imageProcessor->moveToThread(thread);
     thread->start();
 
+    //Exports run on their own thread so that a new stack can be started while saving
+    imageExporter = new ImageExporter();
+    connect(this, &MainWindow::exportImage, imageExporter, &ImageExporter::export_image);
+    connect(imageExporter, &ImageExporter::progress, this, &MainWindow::progress);
+    connect(imageExporter, &ImageExporter::exportComplete, this, &MainWindow::exportComplete);
+    QThread *exportThread = new QThread();
+    imageExporter->moveToThread(exportThread);
+    exportThread->start();
+
     // Synchronize the spinboxes and sliders
     connect(ui->LaplacianKernelSlider, &QSlider::valueChanged, [=](int value) {
         int oddValue = (value % 2 == 0) ? value + 1 : value;
@@ -135,19 +181,35 @@ void MainWindow::on_action_Open_File_triggered()
 
     //Iterate through each file selected
     for(QString file: fileNames){
-        QString name = file.split("/").last();
+        addLayer(file);
+    }
+}
+
+/// Adds an image file to the layers list
+/// \param file The image path
+void MainWindow::addLayer(const QString &file){
+    QString name = file.split("/").last();
 
-        //Add each image to the listWidget with preview image and filename included
-        QListWidgetItem *item = new QListWidgetItem();
-        item->setText(name);
+    //Add each image to the listWidget with preview image and filename included
+    QListWidgetItem *item = new QListWidgetItem();
+    item->setText(name);
 
-        //Set icon to the image selected
-        item->setIcon(QIcon(file));
+    //Set icon to the image selected
+    item->setIcon(QIcon(file));
 
-        item->setData(Qt::UserRole,file);
+    item->setData(Qt::UserRole,file);
 
-        ui->LayersList->addItem(item);
+    ui->LayersList->addItem(item);
+}
+
+/// Returns the image paths of the layers list in order
+/// \return The image paths
+QStringList MainWindow::layerFiles() const{
+    QStringList files;
+    for(int i=0; i<ui->LayersList->count(); i++){
+        files << ui->LayersList->item(i)->data(Qt::UserRole).toString();
     }
+    return files;
 }
 
 /// Displays the selected image from the listWidget in the QGraphicsView
@@ -170,40 +232,68 @@ void MainWindow::on_LayersList_currentRowChanged(int currentRow)
     }
 }
 
-/// When the user clicks the Stack button
-void MainWindow::on_StackButton_clicked()
+/// Returns the layer files if they can be stacked, otherwise tells the user why not
+/// \return The layer files, empty if they can not be stacked
+QStringList MainWindow::stackableFiles()
 {
     //Show message box if layers list is empty
     if(ui->LayersList->count() == 0){
         QMessageBox::warning(this,"Error","No images to stack");
-        return;
+        return QStringList();
     }
 
-    //Create cv::Mat from each image in LayersList
-    std::vector<cv::Mat> images;
-    for(int i=0; i<ui->LayersList->count(); i++){
-        QListWidgetItem *item = ui->LayersList->item(i);
-        QString imagePath = item->data(Qt::UserRole).toString();
-        cv::Mat image = cv::imread(imagePath.toStdString());
-        images.push_back(image);
-    }
-
-    //Make sure that images have the same size
-    for(int i=1; i<images.size(); i++){
-        if(images[i].size() != images[0].size()){
+    //Make sure that images have the same size, only the image headers are read here.
+    //The images are decoded by the processing pipeline.
+    QStringList files = layerFiles();
+    QSize baseSize = QImageReader(files[0]).size();
+    for(int i=1; i<files.size(); i++){
+        if(QImageReader(files[i]).size() != baseSize){
             QMessageBox::warning(this,"Error","Images must have the same size");
-            return;
+            return QStringList();
         }
     }
+    return files;
+}
+
+/// When the user clicks the Stack button
+void MainWindow::on_StackButton_clicked()
+{
+    QStringList files = stackableFiles();
+    if(files.isEmpty()){
+        return;
+    }
 
     //Emit signal to process images
-    int laplaceKernelSize = ui->LaplacianKernelSpinBox->value();
-    int smoothKernelSize = ui->SmoothKernelSpinbox->value();
-    int smoothStrength = ui->SmoothStrengthSpinBox->value();
-    int smoothIterations = ui->SmoothIterations->value();
-    bool blendLayers = ui->BlendLayers->isChecked();
+    StackParameters stackParams = stackParameters();
+
+    //Reuse the stored alignment and depth map when only the compositing options have changed
+    QMap<QString, QVariant> params = currentParameters();
+    bool reuseState = files == stackedFiles
+                      && layerTransforms.size() == static_cast<size_t>(files.size())
+                      && !rawDepthMap.empty()
+                      && params["Laplacian Kernel size"] == stackedParams["Laplacian Kernel size"]
+                      && params["Depth resolution"] == stackedParams["Depth resolution"]
+                      && params["Prune layers"] == stackedParams["Prune layers"]
+                      && params["Fast alignment"] == stackedParams["Fast alignment"]
+                      && params["Plan execution"] == stackedParams["Plan execution"]
+                      && !(stackParams.singlePass && !stackParams.blendLayers);
+
+    if(reuseState){
+        bool reuseSmoothing = !depthMap.empty()
+                              && params["Smooth Kernel size"] == stackedParams["Smooth Kernel size"]
+                              && params["Smooth strength"] == stackedParams["Smooth strength"]
+                              && params["Smooth iterations"] == stackedParams["Smooth iterations"];
+        emit recompositeImages(files, layerTransforms, rawDepthMap, reuseSmoothing ? depthMap : cv::Mat(), stateParameters());
+    }
+    else{
+        layerTransforms.clear();
+        rawDepthMap.release();
+        depthMap.release();
+        emit focusStackImages(files, stackParams);
+    }
+    stackedFiles = files;
+    stackedParams = params;
 
-    emit focusStackImages(images,laplaceKernelSize,smoothKernelSize,smoothStrength,smoothIterations,blendLayers);
     ui->StackButton->setEnabled(false);
     ui->StackButton->setHidden(true);
 
@@ -220,6 +310,14 @@ void MainWindow::focusStackingComplete(cv::Mat focusedImage){
     ui->ProgressBar->setHidden(true);
     ui->ProgressLabel->setHidden(true);
 
+    if(focusedImage.empty()){
+        QMessageBox::warning(this,"Error","Images could not be stacked.");
+        return;
+    }
+
+    //Keep the result at its own bit depth for exporting
+    resultImage = focusedImage;
+
     //Ensure focusedImage is 8-bit and has 3 channels (BGR)
     if (focusedImage.type() != CV_8UC3) {
         focusedImage.convertTo(focusedImage, CV_8UC3);
@@ -263,7 +361,7 @@ void MainWindow::showImageInScene(const QImage &image, QGraphicsScene *scene, in
 void MainWindow::on_action_Save_File_triggered()
 {
     //Only ask for save directory if stackresult in not empty, else display dialog.
-    if(stackresult.isNull()){
+    if(resultImage.empty()){
         QMessageBox::warning(this,"Error","No image to save.");
         return;
     }
@@ -273,15 +371,49 @@ void MainWindow::on_action_Save_File_triggered()
     if (dialog.exec() == QDialog::Accepted) {
         int quality = dialog.getImageQuality();
         //Ask to save the image
-        QString fileName = QFileDialog::getSaveFileName(this, "Save Image", "/stacked-image", "PNG Image (*.png);;JPEG Image (*.jpg)");
+        QString fileName = QFileDialog::getSaveFileName(this, "Save Image", "/stacked-image", "PNG Image (*.png);;JPEG Image (*.jpg);;TIFF Image (*.tif);;Tiled BigTIFF Image (*.btf)");
         if(!fileName.isEmpty()){
-            stackresult.save(fileName,nullptr,quality);
-            //Display information dialog when save is complete
-            QMessageBox::information(this,"Success","Image saved.");
+            //The additional formats are written next to the selected file in the same pass
+            QFileInfo info(fileName);
+            QString baseName = info.dir().filePath(info.completeBaseName());
+            QStringList files(fileName);
+            if(dialog.getExportTiff() && !files.contains(baseName + ".tif")){
+                files << baseName + ".tif";
+            }
+            if(dialog.getExportBigTiff() && !files.contains(baseName + ".btf")){
+                files << baseName + ".btf";
+            }
+
+            pendingExports++;
+            emit exportImage(resultImage, files, quality);
         }
     }
 }
 
+/// When the image exporter has written all files
+/// \param failedFiles The files that could not be written
+void MainWindow::exportComplete(QStringList failedFiles)
+{
+    //A parameter sweep exports several images, report once all of them are written
+    failedExports << failedFiles;
+    if(--pendingExports > 0){
+        return;
+    }
+    pendingExports = 0;
+
+    ui->ProgressBar->setHidden(true);
+    ui->ProgressLabel->setHidden(true);
+
+    //Display information dialog when save is complete
+    if(failedExports.isEmpty()){
+        QMessageBox::information(this,"Success","Image saved.");
+    }
+    else{
+        QMessageBox::warning(this,"Error","Could not save " + failedExports.join(", "));
+    }
+    failedExports.clear();
+}
+
 /// Displays the rendered image in the RenderImage QGraphicsView
 /// \param image The image to display
 /// \param grayscale Whether the image is grayscale or not
@@ -330,12 +462,7 @@ void MainWindow::progress(QString label, int value, int max){
 void MainWindow::on_SaveParams_clicked()
 {
     // Define parameters
-    QMap<QString, QVariant> params;
-    params["Laplacian Kernel size"] = ui->LaplacianKernelSpinBox->value();
-    params["Smooth Kernel size"] = ui->SmoothKernelSpinbox->value();
-    params["Smooth strength"] = ui->SmoothStrengthSpinBox->value();
-    params["Smooth iterations"] = ui->SmoothIterations->value();
-    params["Blend layers"] = ui->BlendLayers->isChecked();
+    QMap<QString, QVariant> params = currentParameters();
 
     //Prompt the user to select a path to save the settingsfile.
     QString filePath = QFileDialog::getSaveFileName(this, "Save Parameters", qApp->applicationDirPath() + "/settings", "Parameters (*.param)");
@@ -359,11 +486,7 @@ void MainWindow::on_LoadParams_clicked()
             QMessageBox::warning(this,"Error","Could not load parameters.");
             return;
         }
-        ui->LaplacianKernelSpinBox->setValue(params["Laplacian Kernel size"].toUInt());
-        ui->SmoothKernelSpinbox->setValue(params["Smooth Kernel size"].toUInt());
-        ui->SmoothStrengthSpinBox->setValue(params["Smooth strength"].toDouble());
-        ui->SmoothIterations->setValue(params["Smooth iterations"].toUInt());
-        ui->BlendLayers->setChecked(params["Blend layers"].toBool());
+        applyParameters(params);
         QMessageBox::information(this,"Success","Parameters loaded.");
     }
 }
@@ -377,6 +500,13 @@ void MainWindow::on_RestoreDefault_clicked()
     ui->SmoothStrengthSpinBox->setValue(100);
     ui->SmoothIterations->setValue(5);
     ui->BlendLayers->setChecked(true);
+    ui->DepthResolution->setCurrentIndex(0);
+    ui->PruneLayers->setChecked(false);
+    ui->SlabSize->setValue(0);
+    ui->DeferredWarp->setChecked(false);
+    ui->SinglePass->setChecked(false);
+    ui->FastAlignment->setChecked(false);
+    ui->PlanExecution->setChecked(false);
 }
 
 /// When the How to use action is triggered
@@ -400,3 +530,454 @@ void MainWindow::on_action_About_triggered()
 
 }
 
+/// Returns the current parameter values
+/// \return The parameters
+QMap<QString, QVariant> MainWindow::currentParameters() const
+{
+    QMap<QString, QVariant> params;
+    params["Laplacian Kernel size"] = ui->LaplacianKernelSpinBox->value();
+    params["Smooth Kernel size"] = ui->SmoothKernelSpinbox->value();
+    params["Smooth strength"] = ui->SmoothStrengthSpinBox->value();
+    params["Smooth iterations"] = ui->SmoothIterations->value();
+    params["Blend layers"] = ui->BlendLayers->isChecked();
+    params["Depth resolution"] = ui->DepthResolution->currentData().toInt();
+    params["Prune layers"] = ui->PruneLayers->isChecked();
+    params["Slab size"] = ui->SlabSize->value();
+    params["Deferred warping"] = ui->DeferredWarp->isChecked();
+    params["Single pass"] = ui->SinglePass->isChecked();
+    params["Fast alignment"] = ui->FastAlignment->isChecked();
+    params["Plan execution"] = ui->PlanExecution->isChecked();
+    return params;
+}
+
+/// Returns the current parameter values for the image processor
+/// \return The stacking parameters
+StackParameters MainWindow::stackParameters() const
+{
+    StackParameters params;
+    params.laplaceKernelSize = ui->LaplacianKernelSpinBox->value();
+    params.smoothKernelSize = ui->SmoothKernelSpinbox->value();
+    params.smoothStrength = ui->SmoothStrengthSpinBox->value();
+    params.smoothIterations = ui->SmoothIterations->value();
+    params.blendLayers = ui->BlendLayers->isChecked();
+    params.depthScale = ui->DepthResolution->currentData().toInt();
+    params.pruneLayers = ui->PruneLayers->isChecked();
+    params.slabSize = ui->SlabSize->value();
+    params.deferredWarp = ui->DeferredWarp->isChecked();
+    params.singlePass = ui->SinglePass->isChecked();
+    params.translationFirst = ui->FastAlignment->isChecked();
+    params.planExecution = ui->PlanExecution->isChecked();
+    return params;
+}
+
+/// Returns the parameters for reusing the stored alignment and depth maps. The compositing options
+/// come from the controls, the depth resolution and the memory mode from the run that computed the
+/// state, so that a raw depth map the planner estimated at a lower resolution is smoothed at it.
+/// \return The stacking parameters
+StackParameters MainWindow::stateParameters() const
+{
+    StackParameters params = stackParameters();
+    params.depthScale = stateParams.depthScale;
+    params.deferredWarp = stateParams.deferredWarp;
+    params.tileSize = stateParams.tileSize;
+    params.planExecution = false;
+    return params;
+}
+
+/// Sets the parameter controls from loaded values
+/// \param params The parameters
+void MainWindow::applyParameters(const QMap<QString, QVariant> &params)
+{
+    ui->LaplacianKernelSpinBox->setValue(params["Laplacian Kernel size"].toUInt());
+    ui->SmoothKernelSpinbox->setValue(params["Smooth Kernel size"].toUInt());
+    ui->SmoothStrengthSpinBox->setValue(params["Smooth strength"].toDouble());
+    ui->SmoothIterations->setValue(params["Smooth iterations"].toUInt());
+    ui->BlendLayers->setChecked(params["Blend layers"].toBool());
+
+    //Parameter files from older versions do not have a depth resolution
+    int depthResolution = ui->DepthResolution->findData(params.value("Depth resolution", 1).toInt());
+    ui->DepthResolution->setCurrentIndex(std::max(0, depthResolution));
+    ui->PruneLayers->setChecked(params.value("Prune layers", false).toBool());
+    ui->SlabSize->setValue(params.value("Slab size", 0).toInt());
+    ui->DeferredWarp->setChecked(params.value("Deferred warping", false).toBool());
+    ui->SinglePass->setChecked(params.value("Single pass", false).toBool());
+    ui->FastAlignment->setChecked(params.value("Fast alignment", false).toBool());
+    ui->PlanExecution->setChecked(params.value("Plan execution", false).toBool());
+}
+
+/// Stores the intermediate results of a run so that they can be reused and saved in a project
+/// \param transforms The per layer alignment transforms
+/// \param rawDepthMap The raw depth map
+/// \param depthMap The smoothed depth map
+/// \param params The parameters the state was computed with, which the planner may have changed
+void MainWindow::stackStateAvailable(std::vector<cv::Mat> transforms, cv::Mat rawDepthMap, cv::Mat depthMap, StackParameters params)
+{
+    layerTransforms = transforms;
+    this->rawDepthMap = rawDepthMap;
+    this->depthMap = depthMap;
+    stateParams = params;
+
+    //Stored in projects, so that a reopened raw depth map is smoothed at its own resolution
+    stackedParams["Applied depth resolution"] = params.depthScale;
+}
+
+/// When the Open Project action is triggered
+void MainWindow::on_action_Open_Project_triggered()
+{
+    QString filePath = QFileDialog::getOpenFileName(this, "Open Project", qApp->applicationDirPath(), "FocusPocus project (*.fpproj)");
+    if(filePath.isEmpty()){
+        return;
+    }
+
+    Project project;
+    if(!Project::load(filePath, project)){
+        QMessageBox::warning(this,"Error","Could not open project.");
+        return;
+    }
+
+    ui->LayersList->clear();
+    for(const ProjectLayer &layer : project.layers){
+        addLayer(layer.path);
+    }
+    applyParameters(project.parameters);
+
+    //Only reuse the stored alignment and depth maps if the input files are unchanged
+    stackedFiles = project.inputFiles();
+    stackedParams = project.parameters;
+    if(project.verifyInputs()){
+        layerTransforms = project.transforms();
+        rawDepthMap = project.rawDepthMap;
+        depthMap = project.depthMap;
+        stateParams = stackParameters();
+        stateParams.depthScale = project.parameters.value("Applied depth resolution", stateParams.depthScale).toInt();
+    }
+    else{
+        layerTransforms.clear();
+        rawDepthMap.release();
+        depthMap.release();
+        QMessageBox::warning(this,"Warning","Input images have changed since the project was saved, they will be stacked again.");
+    }
+}
+
+/// When the Save Project action is triggered
+void MainWindow::on_action_Save_Project_triggered()
+{
+    if(ui->LayersList->count() == 0){
+        QMessageBox::warning(this,"Error","No images to save in project.");
+        return;
+    }
+
+    QString filePath = QFileDialog::getSaveFileName(this, "Save Project", qApp->applicationDirPath(), "FocusPocus project (*.fpproj)");
+    if(filePath.isEmpty()){
+        return;
+    }
+
+    //Transforms and depth maps are only stored if they belong to the current layers
+    QStringList files = layerFiles();
+    bool hasState = files == stackedFiles && layerTransforms.size() == static_cast<size_t>(files.size());
+
+    Project project;
+    project.parameters = hasState ? stackedParams : currentParameters();
+    for(int i=0; i<files.size(); i++){
+        ProjectLayer layer;
+        layer.path = files[i];
+        layer.hash = Project::hashFile(files[i]);
+        if(hasState){
+            layer.transform = layerTransforms[i];
+        }
+        project.layers.push_back(layer);
+    }
+    if(hasState){
+        project.rawDepthMap = rawDepthMap;
+        project.depthMap = depthMap;
+    }
+
+    if(Project::save(filePath, project)){
+        QMessageBox::information(this,"Success","Project saved.");
+    }
+    else{
+        QMessageBox::warning(this,"Error","Could not save project.");
+    }
+}
+
+/// When the Stack Video or Sequence action is triggered. The frames are streamed from disk
+/// instead of being added to the layers list, so sweeps with hundreds of frames can be stacked.
+void MainWindow::on_action_Stack_Video_triggered()
+{
+    QString filePath = QFileDialog::getOpenFileName(this, "Stack Video or Image Sequence", qApp->applicationDirPath(),
+                                                    "Videos and image sequences (*.mp4 *.mov *.avi *.mkv *.m4v *.mts *.webm *.png *.jpg *.jpeg *.bmp *.tif *.tiff)");
+    if(filePath.isEmpty()){
+        return;
+    }
+
+    bool ok = false;
+    int decimation = QInputDialog::getInt(this, "Frame step", "Use every n:th frame:", 1, 1, 100, 1, &ok);
+    if(!ok){
+        return;
+    }
+
+    //A streamed stack has no layers list, the stored state can not be reused
+    stackedFiles.clear();
+    layerTransforms.clear();
+    rawDepthMap.release();
+    depthMap.release();
+
+    ui->StackButton->setEnabled(false);
+    ui->StackButton->setHidden(true);
+    emit focusStackStream(filePath, decimation, stackParameters());
+}
+
+/// When the Watch Folder action is toggled. While checked, every image that arrives in the folder
+/// is aligned and folded into a running stack, unchecking creates the final result.
+/// \param checked Whether to start or stop watching
+void MainWindow::on_action_Watch_Folder_triggered(bool checked)
+{
+    if(checked){
+        QString folder = QFileDialog::getExistingDirectory(this, "Watch Folder", qApp->applicationDirPath());
+        if(folder.isEmpty()){
+            ui->action_Watch_Folder->setChecked(false);
+            return;
+        }
+
+        //Images already in the folder are stacked first
+        ui->LayersList->clear();
+        stackedFiles.clear();
+        layerTransforms.clear();
+        rawDepthMap.release();
+        depthMap.release();
+        pendingFiles.clear();
+
+        stackedParams = currentParameters();
+        watchedFolder = folder;
+        folderWatcher->addPath(folder);
+        ui->StackButton->setEnabled(false);
+        ui->StackButton->setHidden(true);
+        ui->tabWidget->setCurrentIndex(0);
+
+        emit incrementalBegin(stackParameters());
+        scanWatchedFolder();
+    }
+    else{
+        if(watchedFolder.isEmpty()){
+            return;
+        }
+
+        //Pick up files that arrived since the last scan before finishing
+        watchTimer->stop();
+        folderWatcher->removePath(watchedFolder);
+        for(auto file = pendingFiles.begin(); file != pendingFiles.end(); ++file){
+            file.value() = QFileInfo(file.key()).size();
+        }
+        scanWatchedFolder();
+        watchedFolder.clear();
+
+        stackedFiles = layerFiles();
+        emit incrementalFinish();
+    }
+}
+
+/// Adds the images of the watched folder that have not been stacked yet. A file is only added
+/// once its size is the same in two scans in a row, so half written files are left for later.
+void MainWindow::scanWatchedFolder()
+{
+    if(watchedFolder.isEmpty()){
+        return;
+    }
+
+    QStringList stacked = layerFiles();
+    QDir folder(watchedFolder);
+    const QStringList entries = folder.entryList(QStringList() << "*.png" << "*.jpg" << "*.jpeg" << "*.bmp" << "*.tif" << "*.tiff", QDir::Files, QDir::Name);
+
+    bool waiting = false;
+    for(const QString &entry : entries){
+        QString file = folder.filePath(entry);
+        if(stacked.contains(file)){
+            continue;
+        }
+
+        qint64 size = QFileInfo(file).size();
+        if(size > 0 && pendingFiles.value(file, -1) == size){
+            pendingFiles.remove(file);
+            addLayer(file);
+            emit incrementalAdd(file);
+        }
+        else{
+            pendingFiles[file] = size;
+            waiting = true;
+        }
+    }
+
+    if(waiting && folderWatcher->directories().contains(watchedFolder)){
+        watchTimer->start();
+    }
+}
+
+/// Shows a report from the image processor in the status bar, details are shown as a tooltip
+/// \param summary A one line summary
+/// \param details The report lines
+void MainWindow::showReport(QString summary, QStringList details)
+{
+    ui->statusbar->showMessage(summary);
+    ui->statusbar->setToolTip(details.join("\n"));
+}
+
+/// When the Parameter Sweep action is triggered. The layers are stacked once for every combination
+/// of the entered values, the variants and a contact sheet of them are written to a folder.
+void MainWindow::on_action_Parameter_Sweep_triggered()
+{
+    QStringList files = stackableFiles();
+    if(files.isEmpty()){
+        return;
+    }
+
+    //The swept parameters start out with their current values
+    const QStringList keys = {"Laplacian Kernel size", "Smooth Kernel size", "Smooth strength", "Smooth iterations"};
+    QMap<QString, QVariant> params = currentParameters();
+    QStringList lines;
+    for(const QString &key : keys){
+        lines << key + ": " + params[key].toString();
+    }
+
+    bool ok = false;
+    QString text = QInputDialog::getMultiLineText(this, "Parameter Sweep", "Values to try, separated by commas:", lines.join("\n"), &ok);
+    if(!ok){
+        return;
+    }
+
+    //Every combination of the entered values is a variant, kernel sizes have to be odd
+    std::vector<QMap<QString, QVariant>> variants(1, params);
+    for(const QString &line : text.split('\n', Qt::SkipEmptyParts)){
+        QString key = line.section(':', 0, 0).trimmed();
+        if(!keys.contains(key)){
+            QMessageBox::warning(this,"Error","Unknown parameter: " + key);
+            return;
+        }
+
+        QList<int> values;
+        for(const QString &value : line.section(':', 1).split(',', Qt::SkipEmptyParts)){
+            int number = value.trimmed().toInt(&ok);
+            if(!ok){
+                QMessageBox::warning(this,"Error","Invalid value for " + key + ": " + value.trimmed());
+                return;
+            }
+            values << (key.contains("Kernel") ? (number | 1) : number);
+        }
+
+        std::vector<QMap<QString, QVariant>> combined;
+        for(const QMap<QString, QVariant> &variant : variants){
+            for(int value : values){
+                combined.push_back(variant);
+                combined.back()[key] = value;
+            }
+        }
+        if(!combined.empty()){
+            variants = combined;
+        }
+    }
+
+    const size_t maxVariants = 64;
+    if(variants.size() > maxVariants){
+        QMessageBox::warning(this,"Error",QString("The sweep has %1 combinations, at most %2 are allowed.").arg(variants.size()).arg(maxVariants));
+        return;
+    }
+
+    QString folder = QFileDialog::getExistingDirectory(this, "Sweep Output Folder", qApp->applicationDirPath());
+    if(folder.isEmpty()){
+        return;
+    }
+
+    std::vector<StackParameters> stackParams;
+    for(const QMap<QString, QVariant> &variant : variants){
+        StackParameters variantParams = stackParameters();
+        variantParams.laplaceKernelSize = variant["Laplacian Kernel size"].toInt();
+        variantParams.smoothKernelSize = variant["Smooth Kernel size"].toInt();
+        variantParams.smoothStrength = variant["Smooth strength"].toInt();
+        variantParams.smoothIterations = variant["Smooth iterations"].toInt();
+        stackParams.push_back(variantParams);
+    }
+
+    sweepFolder = folder;
+    sweepParameters = variants;
+    ui->StackButton->setEnabled(false);
+    ui->StackButton->setHidden(true);
+    ui->tabWidget->setCurrentIndex(0);
+    emit parameterSweep(files, stackParams);
+}
+
+/// Shows the contact sheet of a parameter sweep and writes every variant with its parameters
+/// \param contactSheet The downscaled variants in a grid
+/// \param variants The variant images, in the order of the sweep parameters
+void MainWindow::sweepComplete(cv::Mat contactSheet, std::vector<cv::Mat> variants)
+{
+    focusStackingComplete(contactSheet);
+    if(contactSheet.empty() || variants.size() != sweepParameters.size()){
+        return;
+    }
+
+    QDir folder(sweepFolder);
+    for(size_t i = 0; i < variants.size(); i++){
+        QString name = QString("sweep_%1").arg(i + 1, 2, 10, QChar('0'));
+        Settings::save(folder.filePath(name + ".param"), sweepParameters[i]);
+        pendingExports++;
+        emit exportImage(variants[i], QStringList(folder.filePath(name + ".png")), -1);
+    }
+    pendingExports++;
+    emit exportImage(contactSheet, QStringList(folder.filePath("contact_sheet.png")), -1);
+}
+
+/// Tracks the rectangle drawn on the result, the region is stacked again once the mouse is released
+/// \param rubberBandRect The rectangle in view coordinates, null when the mouse was released
+/// \param fromScenePoint The corner where the drag started
+/// \param toScenePoint The current corner
+void MainWindow::resultSelectionChanged(QRect rubberBandRect, QPointF fromScenePoint, QPointF toScenePoint)
+{
+    if(!rubberBandRect.isNull()){
+        selection = QRectF(fromScenePoint, toScenePoint).normalized();
+        return;
+    }
+
+    QRectF sceneRect = resultScene->sceneRect();
+    QRectF selected = selection;
+    selection = QRectF();
+    if(selected.isEmpty() || sceneRect.isEmpty() || resultImage.empty() || !ui->StackButton->isEnabled()){
+        return;
+    }
+
+    //Only a result of the layers in the list can be patched, not a contact sheet or a streamed stack
+    QStringList files = layerFiles();
+    if(files.isEmpty() || files != stackedFiles || layerTransforms.size() != static_cast<size_t>(files.size())
+       || QImageReader(files[0]).size() != QSize(resultImage.cols, resultImage.rows)){
+        QMessageBox::warning(this,"Error","Stack the images before restacking a region.");
+        return;
+    }
+
+    //The result is shown scaled down, map the selection to result pixels
+    double scale = resultImage.cols / sceneRect.width();
+    QRect region = QRect(qFloor(selected.left() * scale), qFloor(selected.top() * scale),
+                         qCeil(selected.width() * scale), qCeil(selected.height() * scale))
+                   .intersected(QRect(0, 0, resultImage.cols, resultImage.rows));
+    if(region.width() < 4 || region.height() < 4){
+        return;
+    }
+
+    ui->StackButton->setEnabled(false);
+    ui->StackButton->setHidden(true);
+    emit restackRegion(files, layerTransforms, region, stateParameters());
+}
+
+/// Patches a region that was stacked again into the result
+/// \param patch The new pixels of the region
+/// \param region The region in result pixels
+void MainWindow::regionRestacked(cv::Mat patch, QRect region)
+{
+    cv::Rect area(region.x(), region.y(), region.width(), region.height());
+    if(patch.empty() || patch.size() != area.size() || (area & cv::Rect(0, 0, resultImage.cols, resultImage.rows)) != area){
+        focusStackingComplete(cv::Mat());
+        return;
+    }
+
+    //The exporter may still be writing the old result, patch a copy
+    cv::Mat patched = resultImage.clone();
+    patch.convertTo(patched(area), patched.type());
+    focusStackingComplete(patched);
+}
@@ -3,16 +3,25 @@
 
 #include <QMainWindow>
 #include <QFileDialog>
+#include <QImageReader>
 #include <QListWidgetItem>
 #include <QGraphicsScene>
+#include <QGraphicsView>
+#include <QtMath>
 #include <imageprocessing.h>
 #include <QThread>
 #include <QMessageBox>
+#include <QInputDialog>
+#include <QFileSystemWatcher>
+#include <QFileInfo>
+#include <QTimer>
 #include <oddslider.h>
 #include <oddspinbox.h>
 #include <settings.h>
 #include <exportdialog.h>
+#include <imageexporter.h>
 #include <aboutdialog.h>
+#include <project.h>
 
 QT_BEGIN_NAMESPACE
 namespace Ui {
@@ -45,6 +54,8 @@ private slots:
 
     void progress(QString label, int value, int max);
 
+    void showReport(QString summary, QStringList details);
+
     void on_SaveParams_clicked();
 
     void on_LoadParams_clicked();
@@ -57,6 +68,28 @@ private slots:
 
     void on_action_About_triggered();
 
+    void on_action_Open_Project_triggered();
+
+    void on_action_Save_Project_triggered();
+
+    void on_action_Stack_Video_triggered();
+
+    void on_action_Watch_Folder_triggered(bool checked);
+
+    void scanWatchedFolder();
+
+    void exportComplete(QStringList failedFiles);
+
+    void stackStateAvailable(std::vector<cv::Mat> transforms, cv::Mat rawDepthMap, cv::Mat depthMap, StackParameters params);
+
+    void on_action_Parameter_Sweep_triggered();
+
+    void sweepComplete(cv::Mat contactSheet, std::vector<cv::Mat> variants);
+
+    void resultSelectionChanged(QRect rubberBandRect, QPointF fromScenePoint, QPointF toScenePoint);
+
+    void regionRestacked(cv::Mat patch, QRect region);
+
 protected:
     void resizeEvent(QResizeEvent* event) override;
 
@@ -66,11 +99,54 @@ private:
     QGraphicsScene *resultScene;
     QGraphicsScene *renderScene;
     ImageProcessing *imageProcessor;
+    ImageExporter *imageExporter;
+    cv::Mat resultImage;
     QImage stackresult;
     QImage layer;
     QImage render;
 
+    //Intermediate results of the last run, reused when only compositing options change
+    QStringList stackedFiles;
+    QMap<QString, QVariant> stackedParams;
+    std::vector<cv::Mat> layerTransforms;
+    cv::Mat rawDepthMap;
+    cv::Mat depthMap;
+    StackParameters stateParams; // The parameters the stored state was computed with, as applied by the planner
+
+    //Watch folder state, files are only added once their size has stopped changing
+    QFileSystemWatcher *folderWatcher;
+    QTimer *watchTimer;
+    QString watchedFolder;
+    QMap<QString, qint64> pendingFiles;
+
+    //Parameter sweep output, one parameter set per variant
+    QString sweepFolder;
+    std::vector<QMap<QString, QVariant>> sweepParameters;
+
+    //Rectangle drawn on the result in scene coordinates
+    QRectF selection;
+
+    //Exports still running, their failures are reported together
+    int pendingExports = 0;
+    QStringList failedExports;
+
+    void addLayer(const QString &file);
+    QStringList layerFiles() const;
+    QStringList stackableFiles();
+    QMap<QString, QVariant> currentParameters() const;
+    StackParameters stackParameters() const;
+    StackParameters stateParameters() const;
+    void applyParameters(const QMap<QString, QVariant> &params);
+
 signals:
-    void focusStackImages(const std::vector<cv::Mat>& unalignedImages,int laplaceKernelSize, int smoothKernelSize, int smoothStrength, int smoothIterations, bool blendLayers);
+    void focusStackImages(const QStringList& files, const StackParameters& params);
+    void focusStackStream(const QString& path, int decimation, const StackParameters& params);
+    void incrementalBegin(const StackParameters& params);
+    void incrementalAdd(const QString& file);
+    void incrementalFinish();
+    void restackRegion(const QStringList& files, const std::vector<cv::Mat>& transforms, const QRect& region, const StackParameters& params);
+    void parameterSweep(const QStringList& files, const std::vector<StackParameters>& variants);
+    void exportImage(const cv::Mat& image, const QStringList& files, int quality);
+    void recompositeImages(const QStringList& files, const std::vector<cv::Mat>& transforms, const cv::Mat& rawDepthMap, const cv::Mat& depthMap, const StackParameters& params);
 };
 #endif // MAINWINDOW_H
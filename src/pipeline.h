@@ -0,0 +1,115 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <opencv2/core/core.hpp>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+
+/// A frame travelling between pipeline stages. Frames are only moved, never copied,
+/// so that a stage hands over its buffer to the next stage without touching the pixels.
+struct PipelineFrame {
+    int index = -1;
+    cv::Mat image;
+
+    PipelineFrame() = default;
+    PipelineFrame(int index, cv::Mat&& image) : index(index), image(std::move(image)) {}
+    PipelineFrame(PipelineFrame&&) = default;
+    PipelineFrame& operator=(PipelineFrame&&) = default;
+    PipelineFrame(const PipelineFrame&) = delete;
+    PipelineFrame& operator=(const PipelineFrame&) = delete;
+};
+
+/// Thread counts for the decode, align and score stages
+struct PipelineConfig {
+    int decodeThreads = 1;
+    int alignThreads = 1;
+    int scoreThreads = 1;
+    int queueCapacity = 2;  // Frames buffered between two stages
+    int opencvThreads = 1;  // Passed to cv::setNumThreads while the pipeline runs
+
+    /// Splits the available cores between the stages, alignment is the most expensive stage
+    static PipelineConfig defaults() {
+        int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        PipelineConfig config;
+        config.decodeThreads = std::clamp(cores / 4, 1, 2);
+        config.alignThreads = std::max(1, cores / 2);
+        config.scoreThreads = std::max(1, cores / 4);
+        config.queueCapacity = 2;
+        config.opencvThreads = std::max(1, cores / (config.alignThreads + config.scoreThreads));
+        return config;
+    }
+};
+
+/// A blocking queue with a fixed capacity. Producers block while the queue is full so that
+/// a fast stage cannot run ahead and fill the memory with frames the next stage is not ready for.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(1, capacity)) {}
+
+    /// Adds an item, blocks while the queue is full
+    /// \return False if the queue was closed
+    bool push(T&& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity || closed; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /// Removes an item, blocks while the queue is empty
+    /// \return False if the queue is closed and drained
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    /// Marks the queue as finished, waiting consumers return once it is drained
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+/// Closes a queue once the last of a group of producer threads has finished
+class StageCounter {
+public:
+    explicit StageCounter(int producers) : remaining(producers) {}
+
+    template <typename T>
+    void finished(BoundedQueue<T>& queue) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--remaining == 0) {
+            queue.close();
+        }
+    }
+
+private:
+    int remaining;
+    std::mutex mutex;
+};
+
+#endif // PIPELINE_H
@@ -0,0 +1,294 @@
+/****************************************************************************
+** File Name:   project.cpp
+**
+** Description:
+**     This file contains the implementation of the Project class, which
+**     stores the input files, parameters, alignment transforms and depth
+**     maps of a stacking run so that it can be reopened without aligning
+**     and scoring the layers again.
+**
+** Author:      Martin Gylling
+** Created On:  2026-10-18
+**
+** Last Modified By: Martin Gylling
+** Last Modified On: 2026-10-18
+**
+** License: LGPL (Lesser General Public License)
+**
+****************************************************************************/
+
+#include "project.h"
+#include "settings.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDataStream>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <cstring>
+
+// Magic bytes at the start of project and sidecar files, padded to 8 bytes with zeros
+static const char ProjectMagic[8] = {'F', 'P', 'P', 'R', 'O', 'J', 0, 0};
+static const char MatMagic[8] = {'F', 'P', 'M', 'A', 'T', 0, 0, 0};
+
+/// Returns the ordered list of input files
+/// \return The input file paths
+QStringList Project::inputFiles() const {
+    QStringList files;
+    for (const ProjectLayer &layer : layers) {
+        files << layer.path;
+    }
+    return files;
+}
+
+/// Returns the per layer transforms in input order
+/// \return The transforms
+std::vector<cv::Mat> Project::transforms() const {
+    std::vector<cv::Mat> result;
+    for (const ProjectLayer &layer : layers) {
+        result.push_back(layer.transform);
+    }
+    return result;
+}
+
+/// Checks that the input files have not changed since the project was saved
+/// \return True if all input files match their stored hash
+bool Project::verifyInputs() const {
+    for (const ProjectLayer &layer : layers) {
+        if (hashFile(layer.path) != layer.hash) {
+            qDebug() << "Warning: Input file has changed -" << layer.path;
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Computes the content hash of a file
+/// \param filePath The file path
+/// \return The SHA-1 hash of the file, empty if the file could not be read
+QByteArray Project::hashFile(const QString &filePath) {
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if (!hash.addData(&file)) {
+        return QByteArray();
+    }
+    return hash.result();
+}
+
+/// Saves a project to a file, depth maps are written as binary sidecar files
+/// \param filePath The file path
+/// \param project The project to save
+/// \return True if the save was successful
+bool Project::save(const QString &filePath, const Project &project) {
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qDebug() << "Error: Could not open file for writing -" << filePath;
+        return false;
+    }
+
+    QDataStream out(&file);
+
+    // Write header and version
+    out.writeRawData(ProjectMagic, sizeof(ProjectMagic));
+    out << Version;
+
+    // Write the ordered input list with hashes and transforms
+    out << quint32(project.layers.size());
+    for (const ProjectLayer &layer : project.layers) {
+        out << layer.path;
+        out << layer.hash;
+
+        cv::Mat transform;
+        if (!layer.transform.empty()) {
+            layer.transform.convertTo(transform, CV_64F);
+        }
+        out << quint8(transform.empty() ? 0 : 1);
+        if (!transform.empty()) {
+            for (int r = 0; r < 2; r++) {
+                for (int c = 0; c < 3; c++) {
+                    out << transform.at<double>(r, c);
+                }
+            }
+        }
+    }
+
+    // Write parameters
+    Settings::writeParameters(out, project.parameters);
+
+    // Write which sidecars are present
+    quint8 sidecars = 0;
+    if (!project.rawDepthMap.empty() && saveMat(sidecarPath(filePath, "argmax"), project.rawDepthMap)) {
+        sidecars |= 0x01;
+    }
+    if (!project.depthMap.empty() && saveMat(sidecarPath(filePath, "depth"), project.depthMap)) {
+        sidecars |= 0x02;
+    }
+    out << sidecars;
+
+    file.close();
+    return out.status() == QDataStream::Ok;
+}
+
+/// Loads a project from a file, the file is memory mapped and parsed in place
+/// \param filePath The file path
+/// \param project Receives the loaded project
+/// \return True if the load was successful
+bool Project::load(const QString &filePath, Project &project) {
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qDebug() << "Error: Could not open file for reading -" << filePath;
+        return false;
+    }
+
+    uchar *data = file.map(0, file.size());
+    if (data == nullptr) {
+        qDebug() << "Error: Could not map file -" << filePath;
+        return false;
+    }
+
+    // Wrap the mapping without copying it
+    QByteArray buffer = QByteArray::fromRawData(reinterpret_cast<const char *>(data), file.size());
+    QDataStream in(buffer);
+
+    // Verify header and version
+    char header[8];
+    in.readRawData(header, 8);
+    QString headerStr = QString::fromUtf8(header, 6).trimmed();
+    quint16 version = 0;
+    in >> version;
+    if (headerStr != "FPPROJ" || version > Version) {
+        qDebug() << "Error: Invalid or unsupported project file -" << filePath;
+        file.unmap(data);
+        return false;
+    }
+
+    // Read the ordered input list
+    project.layers.clear();
+    quint32 layerCount = 0;
+    in >> layerCount;
+    for (quint32 i = 0; i < layerCount && in.status() == QDataStream::Ok; i++) {
+        ProjectLayer layer;
+        in >> layer.path;
+        in >> layer.hash;
+
+        quint8 hasTransform = 0;
+        in >> hasTransform;
+        if (hasTransform) {
+            layer.transform = cv::Mat(2, 3, CV_64F);
+            for (int r = 0; r < 2; r++) {
+                for (int c = 0; c < 3; c++) {
+                    in >> layer.transform.at<double>(r, c);
+                }
+            }
+        }
+        project.layers.push_back(layer);
+    }
+
+    // Read parameters
+    project.parameters = Settings::readParameters(in);
+
+    // Read the sidecars that were written
+    quint8 sidecars = 0;
+    in >> sidecars;
+
+    bool ok = in.status() == QDataStream::Ok;
+    file.unmap(data);
+    file.close();
+
+    if (!ok) {
+        qDebug() << "Error: Truncated project file -" << filePath;
+        return false;
+    }
+
+    project.rawDepthMap = (sidecars & 0x01) ? loadMat(sidecarPath(filePath, "argmax")) : cv::Mat();
+    project.depthMap = (sidecars & 0x02) ? loadMat(sidecarPath(filePath, "depth")) : cv::Mat();
+
+    return true;
+}
+
+/// Returns the path of a sidecar file belonging to a project
+/// \param filePath The project file path
+/// \param suffix The sidecar name
+/// \return The sidecar file path
+QString Project::sidecarPath(const QString &filePath, const QString &suffix) {
+    QFileInfo info(filePath);
+    return info.dir().filePath(info.completeBaseName() + "." + suffix + ".bin");
+}
+
+/// Writes a matrix to a binary sidecar file
+/// \param filePath The file path
+/// \param mat The matrix to write
+/// \return True if the save was successful
+bool Project::saveMat(const QString &filePath, const cv::Mat &mat) {
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qDebug() << "Error: Could not open file for writing -" << filePath;
+        return false;
+    }
+
+    QDataStream out(&file);
+    out.writeRawData(MatMagic, sizeof(MatMagic));
+    out << qint32(mat.rows) << qint32(mat.cols) << qint32(mat.type());
+
+    // Pixel data is stored row by row in native byte order
+    size_t rowSize = mat.cols * mat.elemSize();
+    for (int r = 0; r < mat.rows; r++) {
+        out.writeRawData(reinterpret_cast<const char *>(mat.ptr(r)), static_cast<int>(rowSize));
+    }
+
+    file.close();
+    return out.status() == QDataStream::Ok;
+}
+
+/// Reads a matrix from a binary sidecar file through a memory mapping
+/// \param filePath The file path
+/// \return The matrix, empty if the file could not be read
+cv::Mat Project::loadMat(const QString &filePath) {
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qDebug() << "Warning: Missing sidecar file -" << filePath;
+        return cv::Mat();
+    }
+
+    const qint64 headerSize = 8 + 3 * sizeof(qint32);
+    if (file.size() < headerSize) {
+        return cv::Mat();
+    }
+
+    uchar *data = file.map(0, file.size());
+    if (data == nullptr) {
+        qDebug() << "Error: Could not map file -" << filePath;
+        return cv::Mat();
+    }
+
+    QByteArray header = QByteArray::fromRawData(reinterpret_cast<const char *>(data), headerSize);
+    QDataStream in(header);
+    char magic[8];
+    in.readRawData(magic, 8);
+    qint32 rows = 0, cols = 0, type = 0;
+    in >> rows >> cols >> type;
+
+    // Depth maps are 16 bit fixed point or float, the size must fit into the file before allocating
+    cv::Mat mat;
+    bool validType = type == CV_16UC1 || type == CV_32FC1;
+    if (QString::fromUtf8(magic, 5) == "FPMAT" && validType && rows > 0 && cols > 0) {
+        qint64 dataSize = static_cast<qint64>(rows) * cols * CV_ELEM_SIZE(type);
+        if (file.size() - headerSize >= dataSize) {
+            // A single copy out of the mapping, the matrix is continuous after create()
+            mat.create(rows, cols, type);
+            std::memcpy(mat.data, data + headerSize, dataSize);
+        }
+    }
+
+    file.unmap(data);
+    file.close();
+
+    if (mat.empty()) {
+        qDebug() << "Error: Invalid sidecar file -" << filePath;
+    }
+    return mat;
+}
@@ -0,0 +1,51 @@
+#ifndef PROJECT_H
+#define PROJECT_H
+
+#include <QString>
+#include <QStringList>
+#include <QMap>
+#include <QVariant>
+#include <QByteArray>
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+struct ProjectLayer {
+    QString path;
+    QByteArray hash;
+    cv::Mat transform; // 2x3 alignment transform, empty if the layer could not be aligned
+};
+
+class Project {
+public:
+    static const quint16 Version = 1;
+
+    std::vector<ProjectLayer> layers;
+    QMap<QString, QVariant> parameters;
+    cv::Mat rawDepthMap;
+    cv::Mat depthMap;
+
+    // Returns the ordered list of input files
+    QStringList inputFiles() const;
+
+    // Returns the per layer transforms in input order
+    std::vector<cv::Mat> transforms() const;
+
+    // Returns true if every input file still matches its stored hash
+    bool verifyInputs() const;
+
+    // Static method to save a project and its depth map sidecars
+    static bool save(const QString &filePath, const Project &project);
+
+    // Static method to load a project and its depth map sidecars
+    static bool load(const QString &filePath, Project &project);
+
+    // Static method to compute the content hash of an input file
+    static QByteArray hashFile(const QString &filePath);
+
+private:
+    static QString sidecarPath(const QString &filePath, const QString &suffix);
+    static bool saveMat(const QString &filePath, const cv::Mat &mat);
+    static cv::Mat loadMat(const QString &filePath);
+};
+
+#endif // PROJECT_H
@@ -15,7 +15,7 @@
 **
 ****************************************************************************/
 
-#include "Settings.h"
+#include "settings.h"
 #include <QFile>
 #include <QDataStream>
 #include <QDebug>
@@ -35,30 +35,7 @@ void Settings::save(const QString &filePath, const QMap<QString, QVariant> &para
     // Write header
     out.writeRawData("PARAMS", 8);
 
-    // Write parameter count
-    out << quint16(parameters.size());
-
-    // Write parameters
-    for (auto it = parameters.cbegin(); it != parameters.cend(); ++it) {
-        QByteArray name = it.key().toUtf8();
-        out << quint8(name.size());
-        out.writeRawData(name.constData(), name.size());
-
-        const QVariant &value = it.value();
-        if (value.type() == QVariant::Int) {
-            out << quint8(0x01); // Type: Int
-            out << value.toInt();
-        } else if (value.type() == QVariant::Bool) {
-            out << quint8(0x02); // Type: Bool
-            out << value.toBool();
-        } else if (value.type() == QVariant::Double) {
-            out << quint8(0x03); // Type: Double
-            out << value.toDouble();
-        } else {
-            // Handle other types as needed
-            qDebug() << "Warning: Unsupported value type for parameter -" << it.key();
-        }
-    }
+    writeParameters(out, parameters);
 
     file.close();
 }
@@ -88,6 +65,48 @@ QMap<QString, QVariant> Settings::load(const QString &filePath, bool &ok) {
         return parameters;
     }
 
+    parameters = readParameters(in);
+
+    file.close();
+    return parameters;
+}
+
+/// Writes parameters to a stream
+/// \param out The stream to write to
+/// \param parameters The parameters to write
+void Settings::writeParameters(QDataStream &out, const QMap<QString, QVariant> &parameters) {
+    // Write parameter count
+    out << quint16(parameters.size());
+
+    // Write parameters
+    for (auto it = parameters.cbegin(); it != parameters.cend(); ++it) {
+        QByteArray name = it.key().toUtf8();
+        out << quint8(name.size());
+        out.writeRawData(name.constData(), name.size());
+
+        const QVariant &value = it.value();
+        if (value.type() == QVariant::Int) {
+            out << quint8(0x01); // Type: Int
+            out << value.toInt();
+        } else if (value.type() == QVariant::Bool) {
+            out << quint8(0x02); // Type: Bool
+            out << value.toBool();
+        } else if (value.type() == QVariant::Double) {
+            out << quint8(0x03); // Type: Double
+            out << value.toDouble();
+        } else {
+            // Handle other types as needed
+            qDebug() << "Warning: Unsupported value type for parameter -" << it.key();
+        }
+    }
+}
+
+/// Reads parameters from a stream
+/// \param in The stream to read from
+/// \return The parameters read
+QMap<QString, QVariant> Settings::readParameters(QDataStream &in) {
+    QMap<QString, QVariant> parameters;
+
     // Read parameter count
     quint16 paramCount;
     in >> paramCount;
@@ -125,6 +144,5 @@ QMap<QString, QVariant> Settings::load(const QString &filePath, bool &ok) {
         parameters[name] = value;
     }
 
-    file.close();
     return parameters;
 }
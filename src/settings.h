@@ -4,6 +4,7 @@
 #include <QString>
 #include <QMap>
 #include <QVariant>
+#include <QDataStream>
 
 class Settings {
 public:
@@ -12,6 +13,12 @@ public:
 
     // Static method to load parameters from a file
     static QMap<QString, QVariant> load(const QString &filePath, bool &ok);
+
+    // Static method to write parameters to a stream, shared with the project file
+    static void writeParameters(QDataStream &out, const QMap<QString, QVariant> &parameters);
+
+    // Static method to read parameters from a stream, shared with the project file
+    static QMap<QString, QVariant> readParameters(QDataStream &in);
 };
 
 #endif // SETTINGS_H